@@ -45,6 +45,8 @@ std::string FormatWithCommas(T value)
 static void Repl()
 {
     Evaluator eval;
+    eval.GetHeap().SetThreadCount(std::thread::hardware_concurrency());
+    eval.GetHeap().SetCompacting(true);
 
     std::cout << "Jorvik Scheme: Version 1.0" << std::endl << std::endl;
     std::string prompt = "J >> ";
@@ -55,6 +57,8 @@ static void Repl()
         std::getline(std::cin, line);
         try
         {
+            eval.GetHeap().ResetPeakPoolSize();
+
             // Tokenize
             Cell* tokenized = eval.Tokenize(line);
             if (Evaluator::TestDebugFlag(Evaluator::Debug))
@@ -76,18 +80,26 @@ static void Repl()
                 std::cout << interpreted << std::endl;
             }
 
+            unsigned int peak = eval.GetHeap().GetPeakPoolSize();
+
             // Garbage collect
-            CellAllocator::Instance().GarbageCollect(eval.GetGlobalScope());
+            eval.GetHeap().GarbageCollect(eval.GetGlobalScope());
 
             // Stats
             if (Evaluator::TestDebugFlag(Evaluator::Debug))
             {
-                std::cout << "Free list Size: " << FormatWithCommas(CellAllocator::Instance().GetFreeListSize()) << std::endl;
-                std::cout << "Alloc List Size: " << FormatWithCommas(CellAllocator::Instance().GetPoolSize()) << std::endl;
+                std::cout << "Free list Size: " << FormatWithCommas(eval.GetHeap().GetFreeListSize()) << std::endl;
+                std::cout << "Alloc List Size: " << FormatWithCommas(eval.GetHeap().GetPoolSize()) << std::endl;
 
-                unsigned int cells = CellAllocator::Instance().GetFreeListSize() + CellAllocator::Instance().GetPoolSize();
+                unsigned int cells = eval.GetHeap().GetFreeListSize() + eval.GetHeap().GetPoolSize();
                 std::cout << "Cells: " << FormatWithCommas(cells) << ", Bytes: " << FormatWithCommas(cells * sizeof(Cell)) << std::endl;
                 std::cout << "Cell Size: " << sizeof(Cell) << std::endl;
+                std::cout << "Slabs: " << FormatWithCommas(eval.GetHeap().GetSlabCount()) << ", Cells Per Slab: " << FormatWithCommas(eval.GetHeap().GetCellsPerSlab()) << std::endl;
+                std::cout << "GC Threads: " << eval.GetHeap().GetThreadCount() << ", Mark: " << FormatWithCommas(eval.GetHeap().GetMarkTime()) << "us, Sweep: " << FormatWithCommas(eval.GetHeap().GetSweepTime()) << "us" << std::endl;
+                std::cout << "Peak Cells: " << FormatWithCommas(peak) << ", Bytes: " << FormatWithCommas(peak * sizeof(Cell)) << std::endl;
+                std::cout << "GC Pauses: " << FormatWithCommas(eval.GetHeap().GetStats().pauses) << ", Max: " << FormatWithCommas(eval.GetHeap().GetStats().maxPauseTime) << "us, Last: " << FormatWithCommas(eval.GetHeap().GetStats().pauseTime) << "us" << std::endl;
+                std::cout << "Regions: " << FormatWithCommas(eval.GetHeap().GetRegionCount()) << ", Resident Slabs: " << FormatWithCommas(eval.GetHeap().GetResidentSlabCount()) << std::endl;
+                std::cout << "Symbols: " << FormatWithCommas(Sym::GetCount()) << ", String Literals: " << FormatWithCommas(eval.GetHeap().GetLiteralCount()) << std::endl;
             }
         }
         catch(const std::runtime_error& err)
@@ -0,0 +1,506 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#include "pch.h"
+
+#include "Analyzer.h"
+#include "Interpreter.h"
+#include "Evaluator.h"
+#include "Cell.h"
+#include "Scope.h"
+#include "Errors.h"
+#include "CellAllocator.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+// A constant, or a quoted expression
+struct ConstantNode : public Node
+{
+    ConstantNode(Cell* cell) : Node(cell) {}
+
+    virtual Cell* Execute(Scope*, TailCall&) const override
+    {
+        return pCell;
+    }
+};
+
+// A resolved variable; straight to its slot
+struct LocalNode : public Node
+{
+    LocalNode(Cell* cell) : Node(cell), depth(cell->GetDepth()), index(cell->GetIndex()) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall&) const override
+    {
+        Cell* found = pScope->GetFrame(depth)->GetSlot(index);
+        THROW_ERROR_IF(found == nullptr, pCell, "Variable not found: " << (const std::string)*pCell->GetVariableSymbol());
+        return found;
+    }
+
+    unsigned int depth;
+    unsigned int index;
+};
+
+// ... whose slot holds a box
+struct LocalBoxNode : public LocalNode
+{
+    LocalBoxNode(Cell* cell) : LocalNode(cell) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall&) const override
+    {
+        Cell* found = pScope->GetFrame(depth)->GetSlot(index);
+        if (found != nullptr)
+        {
+            found = found->Unbox();
+        }
+        THROW_ERROR_IF(found == nullptr, pCell, "Variable not found: " << (const std::string)*pCell->GetVariableSymbol());
+        return found;
+    }
+};
+
+// Resolved to its binding
+struct GlobalNode : public Node
+{
+    GlobalNode(Cell* cell) : Node(cell), ppBinding(cell->GetBinding()) {}
+
+    virtual Cell* Execute(Scope*, TailCall&) const override
+    {
+        Cell* found = *ppBinding;
+        THROW_ERROR_IF(found == nullptr, pCell, "Variable not found: " << (const std::string)*pCell->GetVariableSymbol());
+        return found;
+    }
+
+    Cell** ppBinding;
+};
+
+// An unresolved symbol, found by name
+struct VariableNode : public Node
+{
+    VariableNode(Cell* cell) : Node(cell) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall&) const override
+    {
+        Cell* found = pScope->FindVariable(pCell->GetSymbol());
+        THROW_ERROR_IF(found == nullptr, pCell, "Variable not found: " << (const std::string)*pCell->GetSymbol());
+        return found;
+    }
+};
+
+// (set! var value) and (define var value), for each kind of variable.  The cell is the variable.
+struct AssignNode : public Node
+{
+    AssignNode(Cell* cell, std::unique_ptr<Node> value) : Node(cell), value(std::move(value)) {}
+
+    std::unique_ptr<Node> value;
+};
+
+struct SetLocalNode : public AssignNode
+{
+    SetLocalNode(Cell* cell, std::unique_ptr<Node> value) : AssignNode(cell, std::move(value)) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        Cell* pSet = value->Execute(pScope, tail);
+        Scope* pFrame = pScope->GetFrame(pCell->GetDepth());
+        Cell* pSlot = pFrame->GetSlot(pCell->GetIndex());
+        THROW_ERROR_IF(pSlot == nullptr || (pCell->IsBoxed() && pSlot->Unbox() == nullptr), pSet, "Could not set variable: " << (std::string)*pCell->GetVariableSymbol());
+        if (pCell->IsBoxed())
+        {
+            pSlot->SetBox(pSet);
+        }
+        else
+        {
+            pFrame->SetSlot(pCell->GetIndex(), pSet);
+        }
+        return Cell::Void();
+    }
+};
+
+struct SetGlobalNode : public AssignNode
+{
+    SetGlobalNode(Cell* cell, std::unique_ptr<Node> value, Scope* pGlobals) : AssignNode(cell, std::move(value)), pGlobals(pGlobals) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        Cell* pSet = value->Execute(pScope, tail);
+        THROW_ERROR_IF(*pCell->GetBinding() == nullptr, pSet, "Could not set variable: " << (std::string)*pCell->GetVariableSymbol());
+        pGlobals->SetBinding(pCell->GetBinding(), pSet);
+        return Cell::Void();
+    }
+
+    Scope* pGlobals;
+};
+
+struct SetVariableNode : public AssignNode
+{
+    SetVariableNode(Cell* cell, std::unique_ptr<Node> value) : AssignNode(cell, std::move(value)) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        Cell* pSet = value->Execute(pScope, tail);
+        THROW_ERROR_IF(!pScope->SetVariable(pCell->GetSymbol(), pSet), pSet, "Could not set variable: " << (std::string)*pCell->GetSymbol());
+        return Cell::Void();
+    }
+};
+
+// A local is always defined in the call's own frame
+struct DefineLocalNode : public AssignNode
+{
+    DefineLocalNode(Cell* cell, std::unique_ptr<Node> value) : AssignNode(cell, std::move(value)) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        Cell* pDefine = value->Execute(pScope, tail);
+        if (pCell->IsBoxed())
+        {
+            pScope->GetSlot(pCell->GetIndex())->SetBox(pDefine);
+        }
+        else
+        {
+            pScope->SetSlot(pCell->GetIndex(), pDefine);
+        }
+        return Cell::Void();
+    }
+};
+
+struct DefineGlobalNode : public AssignNode
+{
+    DefineGlobalNode(Cell* cell, std::unique_ptr<Node> value, Scope* pGlobals) : AssignNode(cell, std::move(value)), pGlobals(pGlobals) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        pGlobals->SetBinding(pCell->GetBinding(), value->Execute(pScope, tail));
+        return Cell::Void();
+    }
+
+    Scope* pGlobals;
+};
+
+struct DefineVariableNode : public AssignNode
+{
+    DefineVariableNode(Cell* cell, std::unique_ptr<Node> value) : AssignNode(cell, std::move(value)) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        pScope->AddVariable(pCell->GetSymbol(), value->Execute(pScope, tail));
+        return Cell::Void();
+    }
+};
+
+// (if test conseq alt); anything that isn't the boolean false is 'true'
+struct IfNode : public Node
+{
+    IfNode(Cell* cell) : Node(cell) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        Cell* pTest = test->Execute(pScope, tail);
+        if ((pTest->GetType() & Cell::BoolType) && !pTest->GetBool())
+        {
+            return alt->Execute(pScope, tail);
+        }
+        return conseq->Execute(pScope, tail);
+    }
+
+    std::unique_ptr<Node> test;
+    std::unique_ptr<Node> conseq;
+    std::unique_ptr<Node> alt;
+};
+
+// Makes a closure of the lambda form
+struct LambdaNode : public Node
+{
+    LambdaNode(Cell* cell) : Node(cell) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall&) const override
+    {
+        return Cell::Lambda(pCell, pScope->Capture(captures));
+    }
+
+    std::vector<LocalAddress> captures;
+};
+
+// Every expression's value but the last is dropped
+struct BeginNode : public Node
+{
+    BeginNode(Cell* cell) : Node(cell) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const override
+    {
+        for (unsigned int index = 0; index < body.size() - 1; index++)
+        {
+            body[index]->Execute(pScope, tail);
+        }
+        return body.back()->Execute(pScope, tail);
+    }
+
+    std::vector<std::unique_ptr<Node>> body;
+};
+
+// The procedure and its arguments, all evaluated, then called.  A lambda called in tail position is left for the
+// caller of the current lambda to call, so that a loop doesn't grow the stack.
+struct CallNode : public Node
+{
+    CallNode(Cell* cell, bool tail, Analyzer* pAnalyzer) : Node(cell), tail(tail), pAnalyzer(pAnalyzer) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall& tailCall) const override
+    {
+        // Everything held here must survive a collection in a nested call
+        Cell* pProc = proc->Execute(pScope, tailCall);
+        Cell* pArgs = Cell::EmptyList();
+        CellRoot procRoot(pProc);
+        CellRoot argsRoot(pArgs);
+        for (auto& arg : args)
+        {
+            pArgs = pArgs->Append(arg->Execute(pScope, tailCall));
+        }
+
+        if (tail && (pProc->GetType() & Cell::LambdaType))
+        {
+            tailCall.pProc = pProc;
+            tailCall.pArgs = pArgs;
+            return nullptr;
+        }
+        return pAnalyzer->Apply(pProc, pArgs);
+    }
+
+    std::unique_ptr<Node> proc;
+    std::vector<std::unique_ptr<Node>> args;
+    bool tail;
+    Analyzer* pAnalyzer;
+};
+
+// Forms the analyzer doesn't handle itself, such as badly formed ones, which the interpreter reports as it would
+struct InterpretNode : public Node
+{
+    InterpretNode(Cell* cell, Interpreter* pInterpreter) : Node(cell), pInterpreter(pInterpreter) {}
+
+    virtual Cell* Execute(Scope* pScope, TailCall&) const override
+    {
+        return pInterpreter->Interpret(pCell, pScope);
+    }
+
+    Interpreter* pInterpreter;
+};
+
+Analyzer::Analyzer(Evaluator* pScheme, Interpreter* pInterpreter)
+    : _pScheme(pScheme),
+    _pInterpreter(pInterpreter)
+{
+}
+
+// The expression's nodes are only needed while it runs.  Nothing here is a safe point, so the cells they refer to
+// stay where they are.
+Cell* Analyzer::Run(Cell* cell, Scope* pScope)
+{
+    std::unique_ptr<Node> node(Analyze(cell, true));
+    TailCall tail;
+    Cell* pResult = node->Execute(pScope, tail);
+    if (tail.pProc != nullptr)
+    {
+        return Apply(tail.pProc, tail.pArgs);
+    }
+    return pResult;
+}
+
+// A lambda's call gets a frame, and executes its body; a tail call it ends with replaces it, and goes round again.
+// An intrinsic procedure is just called.
+Cell* Analyzer::Apply(Cell* pProc, Cell* pArgs)
+{
+    CellRoot procRoot(pProc);
+    CellRoot argsRoot(pArgs);
+    FrameGuard frame;
+
+    for (;;)
+    {
+        CellAllocator::Instance().SafePoint();
+
+        if (pProc->GetType() & Cell::LambdaType)
+        {
+            NodeCode* pCode = GetCode(pProc);
+            Scope* pScope = frame.Call(pProc->GetScope());
+            pScope->Bind(pCode->pParams, pArgs);
+            pScope->BoxSlots(pCode->boxed);
+
+            TailCall tail;
+            Cell* pResult = pCode->body->Execute(pScope, tail);
+            if (tail.pProc == nullptr)
+            {
+                return pResult;
+            }
+            pProc = tail.pProc;
+            pArgs = tail.pArgs;
+            continue;
+        }
+        else if (pProc->GetType() & Cell::ProcedureType)
+        {
+            return pProc->GetProcedure()(pArgs);
+        }
+        THROW_ERROR(pProc, "Is not a procedure: " << pProc);
+    }
+}
+
+// A lambda's nodes are owned by a cell on its form, which keeps them as long as the lambda is around
+NodeCode* Analyzer::GetCode(Cell* pLambda)
+{
+    Cell* pInfo = pLambda->GetLambdaInfo();
+    THROW_ERROR_IF(pInfo == nullptr, pLambda, "Lambda has not been resolved: " << pLambda);
+
+    Cell* pCode = pLambda->GetLambdaCode();
+    if (pCode == nullptr || pCode->GetCode() == nullptr || pCode->GetCode()->backend != CompiledCode::NodeBackend)
+    {
+        std::unique_ptr<NodeCode> code(new NodeCode());
+        code->pParams = pLambda->Car();
+        pLambda->GetLambdaBoxed(code->boxed);
+        code->body = Analyze(pLambda->Cdr()->Car(), true);
+
+        pCode = Cell::Code(code.release());
+        pLambda->SetLambdaCode(pCode);
+    }
+    return static_cast<NodeCode*>(pCode->GetCode());
+}
+
+// A node for each kind of expression, with the special forms picked out by their head.  Only a call can be in
+// tail position; the other nodes pass the tail on to the expressions they end with.
+std::unique_ptr<Node> Analyzer::Analyze(Cell* cell, bool tail)
+{
+    typedef std::unique_ptr<Node> tNode;
+    if (cell->GetType() & Cell::LocalType)
+    {
+        return cell->IsBoxed() ? tNode(new LocalBoxNode(cell)) : tNode(new LocalNode(cell));
+    }
+    else if (cell->GetType() & Cell::GlobalType)
+    {
+        return tNode(new GlobalNode(cell));
+    }
+    else if (cell->GetType() & Cell::SymbolType)
+    {
+        return tNode(new VariableNode(cell));
+    }
+    else if (cell->IsAtom())
+    {
+        return tNode(new ConstantNode(cell));
+    }
+    else if (cell->GetType() & Cell::PairType)
+    {
+        if (cell->Length() == 0)
+        {
+            return tNode(new InterpretNode(cell, _pInterpreter));
+        }
+        else if (cell->Car()->GetType() & Cell::SymbolType)
+        {
+            switch (cell->Car()->GetSymbol()->GetForm())
+            {
+            case Sym::QuoteForm:
+                return tNode(new ConstantNode(cell->Cdr()->Car()));
+            case Sym::IfForm:
+                return Analyze_If(cell, tail);
+            case Sym::SetForm:
+                return Analyze_Set(cell, false);
+            case Sym::DefineForm:
+                return Analyze_Set(cell, true);
+            case Sym::LambdaForm:
+                return Analyze_Lambda(cell);
+            case Sym::BeginForm:
+                return Analyze_Begin(cell, tail);
+            default:
+                break;
+            }
+        }
+        return Analyze_Call(cell, tail);
+    }
+    return tNode(new ConstantNode(cell));
+}
+
+std::unique_ptr<Node> Analyzer::Analyze_If(Cell* cell, bool tail)
+{
+    IfNode* pNode = new IfNode(cell);
+    std::unique_ptr<Node> node(pNode);
+    pNode->test = Analyze(cell->Cdr()->Car(), false);
+    pNode->conseq = Analyze(cell->Cdr()->Cdr()->Car(), tail);
+    pNode->alt = Analyze(cell->Cdr()->Cdr()->Cdr()->Car(), tail);
+    return node;
+}
+
+std::unique_ptr<Node> Analyzer::Analyze_Set(Cell* cell, bool define)
+{
+    Cell* pSymbol = cell->Cdr()->Car();
+    if (!(pSymbol->GetType() & (Cell::LocalType | Cell::GlobalType | Cell::SymbolType)))
+    {
+        return std::unique_ptr<Node>(new InterpretNode(cell, _pInterpreter));
+    }
+
+    std::unique_ptr<Node> value = Analyze(cell->Cdr()->Cdr()->Car(), false);
+    Scope* pGlobals = _pScheme->GetGlobalScope();
+    if (pSymbol->GetType() & Cell::LocalType)
+    {
+        return define ? std::unique_ptr<Node>(new DefineLocalNode(pSymbol, std::move(value))) : 
+            std::unique_ptr<Node>(new SetLocalNode(pSymbol, std::move(value)));
+    }
+    else if (pSymbol->GetType() & Cell::GlobalType)
+    {
+        return define ? std::unique_ptr<Node>(new DefineGlobalNode(pSymbol, std::move(value), pGlobals)) : 
+            std::unique_ptr<Node>(new SetGlobalNode(pSymbol, std::move(value), pGlobals));
+    }
+    return define ? std::unique_ptr<Node>(new DefineVariableNode(pSymbol, std::move(value))) : 
+        std::unique_ptr<Node>(new SetVariableNode(pSymbol, std::move(value)));
+}
+
+std::unique_ptr<Node> Analyzer::Analyze_Lambda(Cell* cell)
+{
+    LambdaNode* pNode = new LambdaNode(cell);
+    std::unique_ptr<Node> node(pNode);
+    cell->Car()->GetLambdaCaptures(pNode->captures);
+    return node;
+}
+
+std::unique_ptr<Node> Analyzer::Analyze_Begin(Cell* cell, bool tail)
+{
+    if (cell->Length() < 2)
+    {
+        return std::unique_ptr<Node>(new InterpretNode(cell, _pInterpreter));
+    }
+
+    BeginNode* pNode = new BeginNode(cell);
+    std::unique_ptr<Node> node(pNode);
+    for (Cell* pList = cell->Cdr(); pList != nullptr && pList->Car() != nullptr; pList = pList->Cdr())
+    {
+        bool last = pList->Cdr() == nullptr || pList->Cdr()->Car() == nullptr;
+        pNode->body.push_back(Analyze(pList->Car(), tail && last));
+    }
+    return node;
+}
+
+std::unique_ptr<Node> Analyzer::Analyze_Call(Cell* cell, bool tail)
+{
+    CallNode* pNode = new CallNode(cell, tail, this);
+    std::unique_ptr<Node> node(pNode);
+    pNode->proc = Analyze(cell->Car(), false);
+    for (Cell* pArg = cell->Cdr(); pArg != nullptr && pArg->Car() != nullptr; pArg = pArg->Cdr())
+    {
+        pNode->args.push_back(Analyze(pArg->Car(), false));
+    }
+    return node;
+}
+
+}
+}
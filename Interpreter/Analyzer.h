@@ -0,0 +1,97 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#pragma once
+#include "Cell.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+class Evaluator;
+class Interpreter;
+
+// A call in tail position, left for the caller of the lambda to make, in place of the lambda's own call
+struct TailCall
+{
+    TailCall() : pProc(nullptr), pArgs(nullptr) {}
+
+    Cell* pProc;
+    Cell* pArgs;
+};
+
+// A node of analysed code.  Each kind of expression has a node of its own, which knows what it is, so executing it
+// goes straight to the work, without looking at the cells again.
+struct Node
+{
+    Node(Cell* cell) : pCell(cell) {}
+    virtual ~Node() {}
+
+    // The node's value at the given scope.  A call in tail position fills in the tail call instead, and returns null.
+    virtual Cell* Execute(Scope* pScope, TailCall& tail) const = 0;
+
+    // The cell the node was made from, which is a constant's value, and is what errors report
+    Cell* pCell;
+};
+
+// The analysed body of a lambda, and how it binds its arguments
+struct NodeCode : public CompiledCode
+{
+    NodeCode() : CompiledCode(NodeBackend), pParams(nullptr) {}
+
+    std::unique_ptr<Node> body;
+    Cell* pParams;
+    std::vector<unsigned int> boxed;
+};
+
+// Analyses resolved code into a tree of nodes, and executes it; a lighter alternative to the virtual machine.
+// Each expression is taken apart once, so the forms, the lengths and the types of its cells are never checked
+// again.  A lambda is analysed when it is first called, and its nodes are kept on its form for the next time.
+// Calls recurse, as they do in the interpreter, and a tail call loops.
+class Analyzer
+{
+public:
+    Analyzer(Evaluator* pScheme, Interpreter* pInterpreter);
+
+    // Analyses the expression, and runs it at the given scope
+    Cell* Run(Cell* cell, Scope* pScope);
+
+    // Calls the procedure with a list of arguments, then any tail calls its lambda ends with
+    Cell* Apply(Cell* pProc, Cell* pArgs);
+
+    Evaluator* GetScheme() const { return _pScheme; }
+    Interpreter* GetInterpreter() const { return _pInterpreter; }
+
+private:
+    std::unique_ptr<Node> Analyze(Cell* cell, bool tail);
+    std::unique_ptr<Node> Analyze_If(Cell* cell, bool tail);
+    std::unique_ptr<Node> Analyze_Set(Cell* cell, bool define);
+    std::unique_ptr<Node> Analyze_Lambda(Cell* cell);
+    std::unique_ptr<Node> Analyze_Begin(Cell* cell, bool tail);
+    std::unique_ptr<Node> Analyze_Call(Cell* cell, bool tail);
+    NodeCode* GetCode(Cell* pLambda);
+
+    Evaluator* _pScheme;
+    Interpreter* _pInterpreter;
+};
+
+}
+}
@@ -29,65 +29,167 @@ namespace Jorvik
 namespace Scheme
 {
 
-// Empty and Void
-static Cell* g_pVoid = nullptr;
-static Cell* g_pEmptyList = nullptr;
+static_assert(sizeof(Cell) == 16, "A cell should be two words: the car and kind, and the cdr or value");
+
+// Immediate values; they never change, so can be shared by everyone
+Cell Cell::ImmediateCells[Cell::NumImmediates];
 
 Cell* Cell::EmptyList()
 {
-    return g_pEmptyList;
+    return &ImmediateCells[EmptyListImmediate];
 }
 
 Cell* Cell::Void()
 {
-    return g_pVoid;
+    return &ImmediateCells[VoidImmediate];
 }
 
 // Init for all cells
 void Cell::StaticInit()
 {
-    g_pVoid = Cell::Symbol(Sym::Symbol("#<void>"));
-    g_pEmptyList = Cell::Pair();
+    ImmediateCells[VoidImmediate].Set(SymbolKind, nullptr);
+    ImmediateCells[VoidImmediate]._pSymbol = Sym::Symbol("#<void>");
+    ImmediateCells[VoidImmediate]._pSymbol->Pin();
+    ImmediateCells[EmptyListImmediate].Set(PairKind, nullptr);
+    ImmediateCells[FalseImmediate].Set(BoolKind, nullptr);
+    ImmediateCells[FalseImmediate]._bool = false;
+    ImmediateCells[TrueImmediate].Set(BoolKind, nullptr);
+    ImmediateCells[TrueImmediate]._bool = true;
+
+    for (tCellInteger value = MinFixnum; value <= MaxFixnum; value++)
+    {
+        Cell& cell = ImmediateCells[FirstFixnumImmediate + (value - MinFixnum)];
+        cell.Set(IntegerKind, nullptr);
+        cell._integer = value;
+    }
 }
 
+// The immediates own no memory, and everything else lives in the allocator's slabs
 void Cell::StaticDestroy()
 {
-    delete g_pVoid;
-    delete g_pEmptyList;
 }
 
 // Constructor
 Cell::Cell()
-    : _ppScope(nullptr),
-    _car(nullptr),
-    _cdr(nullptr),
-    _pAllocatorNext(nullptr)
+    : _head(0),
+    _cdr(nullptr)
 {
 }
 
+// The immediates are never freed, and hold no references; at exit, they can outlive the symbol table
 Cell::~Cell()
 {
-    FreeMemory();
+    if (!IsImmediate(this))
+    {
+        FreeMemory();
+    }
 }
 
 // A simple pair
 Cell* Cell::Pair(Cell* car, Cell* cdr)
 {
     Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = PairType;
-    cell._car = const_cast<Cell*>(car);
-    cell._cdr = const_cast<Cell*>(cdr);
+    cell.Set(PairKind, car);
+    cell._cdr = cdr;
+    return &cell;
+}
+
+// A lambda function, as a flat closure.
+// The car is the (_lambda params body) form it was made from, leaving the value for a frame holding just the
+// variables it captured; null if there are none.
+Cell* Cell::Lambda(Cell* pForm, Scope* pCaptured)
+{
+    Cell& cell = CellAllocator::Instance().Alloc();
+    cell.Set(LambdaKind, pForm);
+    cell._pScope = pCaptured;
+    return &cell;
+}
+
+Cell* Cell::LambdaHead(Cell* pInfo)
+{
+    Cell* pHead = Symbol(Sym::FormSymbol(Sym::LambdaForm));
+    pHead->SetCar(pInfo);
+    return pHead;
+}
+
+// Asked of a lambda, it is its form's head that has it
+Cell* Cell::GetLambdaInfo() const
+{
+    const Cell* pHead = IsLambda() ? GetCar()->GetCar() : this;
+    return pHead->GetKind() == SymbolKind ? pHead->GetCar() : nullptr;
+}
+
+void Cell::GetLambdaCaptures(std::vector<LocalAddress>& captures) const
+{
+    captures.clear();
+    Cell* pInfo = GetLambdaInfo();
+    for (Cell* pSource = pInfo ? pInfo->Car() : nullptr; pSource != nullptr && pSource->Car() != nullptr; pSource = pSource->Cdr())
+    {
+        LocalAddress address;
+        address.depth = uint16_t(pSource->Car()->GetDepth());
+        address.boxed = 0;
+        address.index = pSource->Car()->GetIndex();
+        captures.push_back(address);
+    }
+}
+
+void Cell::GetLambdaBoxed(std::vector<unsigned int>& boxed) const
+{
+    boxed.clear();
+    Cell* pInfo = GetLambdaInfo();
+    for (Cell* pBoxed = pInfo ? pInfo->Cdr()->Car() : nullptr; pBoxed != nullptr && pBoxed->Car() != nullptr; pBoxed = pBoxed->Cdr())
+    {
+        boxed.push_back((unsigned int)pBoxed->Car()->GetInteger());
+    }
+}
+
+Cell* Cell::Code(CompiledCode* pCode)
+{
+    Cell& cell = CellAllocator::Instance().Alloc(true);
+    cell.Set(CodeKind, nullptr);
+    cell._pCode = pCode;
+    return &cell;
+}
+
+Cell* Cell::GetLambdaCode() const
+{
+    Cell* pInfo = GetLambdaInfo();
+    return pInfo ? pInfo->_cdr->_cdr : nullptr;
+}
+
+void Cell::SetLambdaCode(Cell* pCode)
+{
+    Cell* pRest = GetLambdaInfo()->_cdr;
+    pRest->_cdr = pCode;
+    CellAllocator::Instance().WriteBarrier(pRest, pCode);
+}
+
+Cell* Cell::Box(Cell* pValue)
+{
+    return Pair(pValue);
+}
+
+void Cell::SetBox(Cell* pValue)
+{
+    SetCar(pValue);
+    CellAllocator::Instance().WriteBarrier(this, pValue);
+}
+
+Cell* Cell::Local(Cell* pSymbol, unsigned int depth, unsigned int index, bool boxed)
+{
+    Cell& cell = CellAllocator::Instance().Alloc();
+    cell.Set(LocalKind, pSymbol);
+    cell._local.depth = uint16_t(depth);
+    cell._local.boxed = boxed ? 1 : 0;
+    cell._local.index = index;
     return &cell;
 }
 
-// A lambda function with scope
-Cell* Cell::Lambda(Cell* pArgs, Cell* pBody, std::shared_ptr<Scope>& pScope)
+Cell* Cell::Global(Cell* pSymbol, Cell** ppBinding)
 {
     Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = LambdaType;
-    cell._car = const_cast<Cell*>(pArgs);
-    cell._cdr = const_cast<Cell*>(Cell::Pair(pBody));
-    cell._ppScope = new std::shared_ptr<Scope>(pScope);
+    cell.Set(GlobalKind, pSymbol);
+    cell._ppBinding = ppBinding;
     return &cell;
 }
 
@@ -99,7 +201,8 @@ void Cell::AppendInternal(Cell* add)
     }
     else
     {
-        _cdr = const_cast<Cell*>(Cell::Pair(add));
+        _cdr = Cell::Pair(add);
+        CellAllocator::Instance().WriteBarrier(this, _cdr);
     }
     return;
 }
@@ -119,8 +222,8 @@ Cell* Cell::Append(Cell* add)
 
 Cell* Cell::String(const char* pszValue)
 {
-    Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = (StringType | AtomType);
+    Cell& cell = CellAllocator::Instance().Alloc(true);
+    cell.Set(StringKind, nullptr);
     if (pszValue == nullptr)
     {
         cell._pString = new std::string();
@@ -132,38 +235,38 @@ Cell* Cell::String(const char* pszValue)
     return &cell;
 }
 
+// The cell keeps its symbol alive until it is swept
 Cell* Cell::Symbol(const Sym* value)
 {
-    Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = SymbolType | AtomType;
+    Cell& cell = CellAllocator::Instance().Alloc(true);
+    cell.Set(SymbolKind, nullptr);
     cell._pSymbol = value;
+    value->AddRef();
     return &cell;
 }
 
 Cell* Cell::Procedure(tProc procedure, const char* pszTypeName)
 {
-    Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = ProcedureType;
+    Cell& cell = CellAllocator::Instance().Alloc(true);
+    cell.Set(ProcedureKind, pszTypeName ? Cell::Symbol(Sym::Symbol(pszTypeName)) : nullptr);
     cell._pProcedure = new tProc(procedure);
-    if (pszTypeName)
-    {
-        cell._car = const_cast<Cell*>(Cell::Symbol(Sym::Symbol(pszTypeName)));
-    }
     return &cell;
 }
 
 Cell* Cell::Boolean(bool val)
 {
-    Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = (BoolType | AtomType);
-    cell._bool = val;
-    return &cell;
+    return &ImmediateCells[val ? TrueImmediate : FalseImmediate];
 }
 
 Cell* Cell::Integer(tCellInteger val)
 {
+    if (val >= MinFixnum && val <= MaxFixnum)
+    {
+        return &ImmediateCells[FirstFixnumImmediate + (val - MinFixnum)];
+    }
+
     Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = (IntegerType | AtomType);
+    cell.Set(IntegerKind, nullptr);
     cell._integer = val;
     return &cell;
 }
@@ -171,22 +274,23 @@ Cell* Cell::Integer(tCellInteger val)
 Cell* Cell::Float(tCellFloat val)
 {
     Cell& cell = CellAllocator::Instance().Alloc();
-    cell._type = (FloatType | AtomType);
+    cell.Set(FloatKind, nullptr);
     cell._float = val;
     return &cell;
 }
 
 void Cell::FreeMemory()
 {
-    if (_type == Cell::LambdaType)
+    Kind kind = GetKind();
+    if (kind == SymbolKind)
     {
-        if (_ppScope)
+        if (_pSymbol)
         {
-            delete _ppScope;
-            _ppScope = nullptr;
+            _pSymbol->Release();
+            _pSymbol = nullptr;
         }
     }
-    else if (_type == Cell::StringType)
+    else if (kind == StringKind)
     {
         if (_pString)
         {
@@ -194,7 +298,7 @@ void Cell::FreeMemory()
             _pString = nullptr;
         }
     }
-    else if (_type == Cell::ProcedureType)
+    else if (kind == ProcedureKind)
     {
         if (_pProcedure)
         {
@@ -202,6 +306,11 @@ void Cell::FreeMemory()
             _pProcedure = nullptr;
         }
     }
+    else if (kind == CodeKind)
+    {
+        delete _pCode;
+        _pCode = nullptr;
+    }
 }
 
 // Cons adds an expression onto the beginning of existing list
@@ -213,16 +322,17 @@ Cell* Cell::Cons(Cell* cell)
 }
 
 
+// A lambda looks like its (params body) list
 Cell* Cell::Car() const
 {
     THROW_ERROR_IF(!IsPair() && !IsLambda(), this, "Not a pair in Car()");
-    return _car;
+    return IsLambda() ? GetCar()->_cdr->GetCar() : GetCar();
 }
 
 Cell* Cell::Cdr() const
 {
     THROW_ERROR_IF(!IsPair() && !IsLambda(), this, "Not a pair in Cdr()");
-    return _cdr;
+    return IsLambda() ? GetCar()->_cdr->_cdr : _cdr;
 }
 
 // null? is defined only for lists.
@@ -230,7 +340,7 @@ Cell* Cell::Cdr() const
 bool Cell::IsNull() const
 {
     if (IsPair() &&
-        _car == nullptr &&
+        GetCar() == nullptr &&
         _cdr == nullptr)
     {
         return true;
@@ -242,23 +352,23 @@ bool Cell::IsNull() const
 // pair? if we point to something else
 bool Cell::IsPair() const
 {
-    return (_type & PairType);
+    return GetKind() == PairKind;
 }
 
 bool Cell::IsLambda() const
 {
-    return (_type & LambdaType) ? true : false;
+    return GetKind() == LambdaKind;
 }
 
 bool Cell::IsSymbol() const
 {
-    return (_type & SymbolType) ? true : false;
+    return GetKind() == SymbolKind;
 }
 
 // atom? is define as not pair? and not null?
 bool Cell::IsAtom() const
 {
-    return (_type & AtomType) ? true : false;
+    return (GetType() & AtomType) ? true : false;
 }
 
 // TODO - detect circular lists
@@ -269,139 +379,115 @@ unsigned int Cell::Length() const
     while (pCurrent != nullptr && pCurrent->Car())
     {
         length++;
-        pCurrent = pCurrent->_cdr;
+        pCurrent = pCurrent->Cdr();
     }
     return length;
 }
 
 Cell* Cell::Add(Cell* rhs) const
 {
-    Cell& ret = CellAllocator::Instance().Alloc();
-
     // Automatic promote to float.
-    if (_type & IntegerType && rhs->_type & FloatType)
+    if (GetType() & IntegerType && rhs->GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = static_cast<tCellFloat>(_integer) + rhs->_float;
+        return Float(static_cast<tCellFloat>(_integer) + rhs->_float);
     }
-    else if (_type & IntegerType && rhs->_type & IntegerType)
+    else if (GetType() & IntegerType && rhs->GetType() & IntegerType)
     {
-        ret._type = IntegerType;
-        ret._integer = _integer + rhs->_integer;
+        return Integer(_integer + rhs->_integer);
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = _float + (rhs->_type & FloatType ? rhs->_float : rhs->_integer);
+        return Float(_float + (rhs->GetType() & FloatType ? rhs->_float : rhs->_integer));
     }
     else
     {
         throw std::runtime_error("Type not supported in operator +");
     }
-    return &ret;
 }
 
 Cell* Cell::Subtract(Cell* rhs) const
 {
-    Cell& ret = CellAllocator::Instance().Alloc();
-
     // Automatic promote to float.
-    if (_type & IntegerType && rhs->_type & FloatType)
+    if (GetType() & IntegerType && rhs->GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = static_cast<tCellFloat>(_integer) - rhs->_float;
+        return Float(static_cast<tCellFloat>(_integer) - rhs->_float);
     }
-    else if (_type & IntegerType && rhs->_type & IntegerType)
+    else if (GetType() & IntegerType && rhs->GetType() & IntegerType)
     {
-        ret._type = IntegerType;
-        ret._integer = _integer - rhs->_integer;
+        return Integer(_integer - rhs->_integer);
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = _float - (rhs->_type & FloatType ? rhs->_float : rhs->_integer);
+        return Float(_float - (rhs->GetType() & FloatType ? rhs->_float : rhs->_integer));
     }
     else
     {
         throw std::runtime_error("Type not supported in operator -");
     }
-    return &ret;
 }
 
 Cell* Cell::Multiply(Cell* rhs) const
 {
-    Cell& ret = CellAllocator::Instance().Alloc();
-
     // Automatic promote to float.
-    if (_type & IntegerType && rhs->_type & FloatType)
+    if (GetType() & IntegerType && rhs->GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = static_cast<tCellFloat>(_integer) * rhs->_float;
+        return Float(static_cast<tCellFloat>(_integer) * rhs->_float);
     }
-    else if (_type & IntegerType && rhs->_type & IntegerType)
+    else if (GetType() & IntegerType && rhs->GetType() & IntegerType)
     {
-        ret._type = IntegerType;
-        ret._integer = _integer * rhs->_integer;
+        return Integer(_integer * rhs->_integer);
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = _float * (rhs->_type & FloatType ? rhs->_float : rhs->_integer);
+        return Float(_float * (rhs->GetType() & FloatType ? rhs->_float : rhs->_integer));
     }
     else
     {
         throw std::runtime_error("Type not supported in operator *");
     }
-    return &ret;
 }
 
 Cell* Cell::Divide(Cell* rhs) const
 {
-    Cell& ret = CellAllocator::Instance().Alloc();
-
     // Automatic promote to float.
-    if (_type & IntegerType && rhs->_type & FloatType)
+    if (GetType() & IntegerType && rhs->GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = static_cast<tCellFloat>(_integer) / rhs->_float;
+        return Float(static_cast<tCellFloat>(_integer) / rhs->_float);
     }
-    else if (_type & IntegerType && rhs->_type & IntegerType)
+    else if (GetType() & IntegerType && rhs->GetType() & IntegerType)
     {
-        ret._type = FloatType;
-        ret._float = _integer / (tCellFloat)rhs->_integer;
+        return Float(_integer / (tCellFloat)rhs->_integer);
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        ret._type = FloatType;
-        ret._float = _float / (rhs->_type & FloatType ? rhs->_float : rhs->_integer);
+        return Float(_float / (rhs->GetType() & FloatType ? rhs->_float : rhs->_integer));
     }
     else
     {
         throw std::runtime_error("Type not supported in operator /");
     }
-    return &ret;
 }
 
 bool Cell::Less(Cell* rhs) const
 {
-    if (_type & IntegerType)
+    if (GetType() & IntegerType)
     {
-        if (rhs->_type & IntegerType)
+        if (rhs->GetType() & IntegerType)
         {
             return GetInteger() < rhs->GetInteger();
         }
-        else if (rhs->_type & FloatType)
+        else if (rhs->GetType() & FloatType)
         {
             return GetInteger() < rhs->GetFloat();
         }
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        if (rhs->_type & IntegerType)
+        if (rhs->GetType() & IntegerType)
         {
             return GetFloat() < rhs->GetInteger();
         }
-        else if (rhs->_type & FloatType)
+        else if (rhs->GetType() & FloatType)
         {
             return GetFloat() < rhs->GetFloat();
         }
@@ -411,24 +497,24 @@ bool Cell::Less(Cell* rhs) const
 
 bool Cell::Greater(Cell* rhs) const
 {
-    if (_type & IntegerType)
+    if (GetType() & IntegerType)
     {
-        if (rhs->_type & IntegerType)
+        if (rhs->GetType() & IntegerType)
         {
             return GetInteger() > rhs->GetInteger();
         }
-        else if (rhs->_type & FloatType)
+        else if (rhs->GetType() & FloatType)
         {
             return GetInteger() > rhs->GetFloat();
         }
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        if (rhs->_type & IntegerType)
+        if (rhs->GetType() & IntegerType)
         {
             return GetFloat() > rhs->GetInteger();
         }
-        else if (rhs->_type & FloatType)
+        else if (rhs->GetType() & FloatType)
         {
             return GetFloat() > rhs->GetFloat();
         }
@@ -438,24 +524,24 @@ bool Cell::Greater(Cell* rhs) const
 
 bool Cell::Equal(Cell* rhs) const
 {
-    if (_type & IntegerType)
+    if (GetType() & IntegerType)
     {
-        if (rhs->_type & IntegerType)
+        if (rhs->GetType() & IntegerType)
         {
             return GetInteger() == rhs->GetInteger();
         }
-        else if (rhs->_type & FloatType)
+        else if (rhs->GetType() & FloatType)
         {
             return GetInteger() == rhs->GetFloat();
         }
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
-        if (rhs->_type & IntegerType)
+        if (rhs->GetType() & IntegerType)
         {
             return GetFloat() == rhs->GetInteger();
         }
-        else if (rhs->_type & FloatType)
+        else if (rhs->GetType() & FloatType)
         {
             return GetFloat() == rhs->GetFloat();
         }
@@ -465,44 +551,42 @@ bool Cell::Equal(Cell* rhs) const
 
 void Cell::ToAtomString(std::ostringstream& str) const
 {
-    if (_type & BoolType)
+    if (GetType() & BoolType)
     {
         str << (_bool ? "#t" : "#f");
     }
-    else if (_type & FloatType)
+    else if (GetType() & FloatType)
     {
         str << std::to_string(_float);
     }
-    else if (_type & IntegerType)
+    else if (GetType() & IntegerType)
     {
         str << std::to_string(_integer);
     }
-    else if (_type & SymbolType)
+    else if (GetType() & SymbolType)
     {
-        if (this != g_pVoid)
+        if (this != Void())
         {
             str << (std::string)*_pSymbol;
         }
     }
-    else if (_type & StringType)
+    else if (GetType() & (LocalType | GlobalType))
+    {
+        GetCar()->ToAtomString(str);
+    }
+    else if (GetType() & StringType)
     {
         // Escape the returned string
         str << "\"" << *_pString << "\"";
     }
-    if (_type & LambdaType)
+    if (GetType() & LambdaType)
     {
         str << "<lambda>";
     }
-    else if (_type & ProcedureType)
+    else if (GetType() & ProcedureType)
     {
-        if (_car != nullptr)
-        {
-            str << _car->ToString();
-        }
-        else
-        {
-            str << "<procedure>";
-        }
+        // The name is for finding the intrinsic again, not for show
+        str << "<procedure>";
     }
 }
 
@@ -510,14 +594,13 @@ void Cell::ToListEntryString(std::ostringstream& str) const
 {
     if (IsPair())
     {
-        if (_car)
+        if (GetCar())
         {
-            std::string car = _car->ToString();
+            std::string car = GetCar()->ToString();
             if (!car.empty())
             {
                 str << " " << car;
             }
-            //_car->ToString(str);
         }
         
         if (_cdr)
@@ -541,16 +624,20 @@ std::string Cell::ToString() const
 
 void Cell::ToString(std::ostringstream& str) const
 {
-    if (!IsPair() && !IsLambda())
+    if (IsLambda())
+    {
+        GetCar()->_cdr->ToString(str);
+    }
+    else if (!IsPair())
     {
         ToAtomString(str);
     }
     else
     {
         str << "(";
-        if (_car)
+        if (GetCar())
         {
-            _car->ToString(str);
+            GetCar()->ToString(str);
         }
 
         if (_cdr)
@@ -563,35 +650,58 @@ void Cell::ToString(std::ostringstream& str) const
 
 std::string Cell::TypeToString() const
 {
-    switch(_type)
+    switch(GetKind())
     {
-    case SymbolType:
+    case SymbolKind:
         return "symbol";
-    case StringType:
+    case StringKind:
         return "string";
-    case IntegerType:
+    case IntegerKind:
         return "integer";
-    case FloatType:
+    case FloatKind:
         return "float";
-    case PairType:
+    case PairKind:
         return "list";
-    case ProcedureType:
+    case ProcedureKind:
         return "procedure";
-    case LambdaType:
+    case LambdaKind:
         return "lambda";
-    case BoolType:
+    case BoolKind:
         return "bool";
+    case LocalKind:
+        return "local";
+    case GlobalKind:
+        return "global";
+    case CodeKind:
+        return "code";
     default:
         return "<unknown>";
     }
 }
 
+// The type flags for each kind of cell
+static const unsigned int KindTypes[] = 
+{
+    Cell::FreeType,
+    Cell::PairType,
+    Cell::SymbolType | Cell::AtomType,
+    Cell::StringType | Cell::AtomType,
+    Cell::IntegerType | Cell::AtomType,
+    Cell::FloatType | Cell::AtomType,
+    Cell::ProcedureType,
+    Cell::LambdaType,
+    Cell::BoolType | Cell::AtomType,
+    Cell::LocalType,
+    Cell::GlobalType,
+    Cell::CodeType
+};
+
 unsigned int Cell::GetType() const
 {
-    return _type; 
+    return KindTypes[GetKind()]; 
 }
  
-#define CHECK_TYPE(a) if (!(a & _type)) throw std::runtime_error("Unexpected type: " #a);
+#define CHECK_TYPE(a) if (!(a & GetType())) throw std::runtime_error("Unexpected type: " #a);
 bool Cell::GetBool() const 
 {
     CHECK_TYPE(BoolType);
@@ -630,11 +740,43 @@ Cell::tProc Cell::GetProcedure() const
 
 Scope* Cell::GetScope() const
 {
-    if (!_ppScope)
-    {
-        return nullptr;
-    }
-    return (*_ppScope).get();
+    return _pScope;
+}
+
+unsigned int Cell::GetDepth() const
+{
+    CHECK_TYPE(LocalType);
+    return _local.depth;
+}
+
+unsigned int Cell::GetIndex() const
+{
+    CHECK_TYPE(LocalType);
+    return _local.index;
+}
+
+bool Cell::IsBoxed() const
+{
+    CHECK_TYPE(LocalType);
+    return _local.boxed != 0;
+}
+
+Cell** Cell::GetBinding() const
+{
+    CHECK_TYPE(GlobalType);
+    return _ppBinding;
+}
+
+const Sym* Cell::GetVariableSymbol() const
+{
+    CHECK_TYPE((LocalType | GlobalType));
+    return GetCar()->GetSymbol();
+}
+
+CompiledCode* Cell::GetCode() const
+{
+    CHECK_TYPE(CodeType);
+    return _pCode;
 }
 
 std::ostream& operator << (std::ostream& stream, Cell* cell)
@@ -32,15 +32,49 @@ namespace Scheme
 
 class Scope;
 class CellAllocator;
+class HeapImage;
+class Resolver;
+
+// Code compiled from a lambda by one of the backends; bytecode for the virtual machine, or a tree of nodes.
+// A code cell owns it, and deletes it through here.
+struct CompiledCode
+{
+    enum Backend
+    {
+        BytecodeBackend,
+        NodeBackend
+    };
+
+    CompiledCode(Backend kind) : backend(kind) {}
+    virtual ~CompiledCode() {}
+
+    Backend backend;
+};
 
 typedef long long tCellInteger;
 typedef float tCellFloat;
 
-class Cell
+// Where a resolved local variable lives; see Cell::Local
+struct LocalAddress
+{
+    uint16_t depth;
+    uint16_t boxed;
+    uint32_t index;
+};
+
+// Cells are 16 byte aligned, which leaves the low bits of a pointer to one free
+#if defined(_MSC_VER)
+#define CELL_ALIGN __declspec(align(16))
+#else
+#define CELL_ALIGN alignas(16)
+#endif
+
+class CELL_ALIGN Cell
 {
 public:    
     enum TypeFlags 
     {
+        FreeType = 0, // Not allocated
         PairType = (1 << 0),
         SymbolType = (1 << 1),
         StringType = (1 << 2),
@@ -50,10 +84,25 @@ public:
         LambdaType = (1 << 6),
         BoolType = (1 << 7),
         AtomType = (1 << 8),
-        DeleteNoGC = (1 << 9)
+        LocalType = (1 << 9),
+        GlobalType = (1 << 10),
+        CodeType = (1 << 11)
     };
 
     typedef std::function<Cell*(Cell* list)> tProc;
+
+    // Small integers, booleans, the empty list and void are immediates.  They are never allocated: each value
+    // has its own fixed cell outside the heap, so the pointer alone identifies it, and the collector ignores it.
+    static const tCellInteger MinFixnum = -32768;
+    static const tCellInteger MaxFixnum = 32767;
+    static bool IsImmediate(const Cell* pCell)
+    {
+        return (uintptr_t)pCell - (uintptr_t)ImmediateCells < sizeof(Cell) * NumImmediates;
+    }
+    static bool IsFixnum(const Cell* pCell)
+    {
+        return (uintptr_t)pCell - (uintptr_t)&ImmediateCells[FirstFixnumImmediate] < sizeof(Cell) * (MaxFixnum - MinFixnum + 1);
+    }
     
     // Static create for the cell pool
     static void StaticInit();
@@ -72,7 +121,40 @@ public:
     static Cell* String(const char* string);
     static Cell* Procedure(tProc procedure, const char* pszTypeName = nullptr);
     static Cell* Boolean(bool val);
-    static Cell* Lambda(Cell* pArgs, Cell* pBody, std::shared_ptr<Scope>& pScope);
+    static Cell* Lambda(Cell* pForm, Scope* pCaptured);
+
+    // The head of a resolved lambda form.  Symbols don't use their car, so this one's holds what the resolver
+    // found out: (captures boxed . code), the local cells that find each captured variable where the closure is
+    // made, the numbers of the frame slots that hold boxes, and the lambda's compiled code, if it has any yet.
+    // Null for a lambda that hasn't been resolved.
+    static Cell* LambdaHead(Cell* pInfo);
+    Cell* GetLambdaInfo() const;
+
+    // The info decoded, for the backends: where each captured value is found, and which slots are boxed
+    void GetLambdaCaptures(std::vector<LocalAddress>& captures) const;
+    void GetLambdaBoxed(std::vector<unsigned int>& boxed) const;
+
+    // Code compiled from a lambda, which the cell owns, so it is freed along with the lambda's form.
+    // Compaction moves the cells the code refers to, so it throws the code away, leaving the cell empty.
+    // A lambda holds code for one backend at a time; another backend compiles it again.
+    static Cell* Code(CompiledCode* pCode);
+    CompiledCode* GetCode() const;
+    Cell* GetLambdaCode() const;
+    void SetLambdaCode(Cell* pCode);
+
+    // A variable that can change after a closure has captured it, so is shared through a box: a pair holding the
+    // value in its car.  The resolver knows which variables are boxed, so a box is never seen as a value.
+    static Cell* Box(Cell* pValue);
+    Cell* Unbox() const { return GetCar(); }
+    void SetBox(Cell* pValue);
+
+    // A variable reference resolved to a lexical address: the call's own frame at depth 0, or the values its
+    // closure captured at depth 1, and the slot in it.
+    // Keeps the symbol it replaced, for errors and printing.
+    static Cell* Local(Cell* pSymbol, unsigned int depth, unsigned int index, bool boxed = false);
+
+    // A variable reference resolved to its binding in the global scope, which never moves
+    static Cell* Global(Cell* pSymbol, Cell** ppBinding);
         
     Cell* Add(Cell* rhs) const;
     Cell* Multiply(Cell* rhs) const;
@@ -118,6 +200,13 @@ public:
     tCellFloat GetFloat() const;
     tProc GetProcedure() const;
     Scope* GetScope() const;
+    unsigned int GetDepth() const;
+    unsigned int GetIndex() const;
+    bool IsBoxed() const;
+    Cell** GetBinding() const;
+
+    // The symbol a local or global variable reference was resolved from, for errors
+    const Sym* GetVariableSymbol() const;
     
     static Cell* Void();
 
@@ -127,27 +216,65 @@ protected:
     
 protected:
 
-    // Variant type
-    unsigned short _type;
-    bool _mark;
-    Cell* _cdr;
-    Cell* _car;
+    // What a cell holds; kept in the low bits of its first word
+    enum Kind
+    {
+        FreeKind,
+        PairKind,
+        SymbolKind,
+        StringKind,
+        IntegerKind,
+        FloatKind,
+        ProcedureKind,
+        LambdaKind,
+        BoolKind,
+        LocalKind,
+        GlobalKind,
+        CodeKind,
+        KindMask = 0xF
+    };
+
+    Kind GetKind() const { return Kind(_head & KindMask); }
+    Cell* GetCar() const { return (Cell*)(_head & ~(uintptr_t)KindMask); }
+    void SetCar(Cell* car) { _head = (uintptr_t)car | (_head & KindMask); }
+    Cell* GetCdr() const { return GetKind() == PairKind ? _cdr : nullptr; }
+    void Set(Kind kind, Cell* car) { _head = (uintptr_t)car | kind; }
+
+    // The car, along with the kind of cell.
+    // This is a pair's car, a procedure's name, a lambda's (params body) list, or a variable's symbol
+    uintptr_t _head;
 
-    // Possible values
+    // The cdr of a pair, or the value of anything else
     union
     {
+        Cell* _cdr;
         bool _bool;
         tCellInteger _integer;
         tCellFloat _float;
         tProc* _pProcedure;    
         std::string* _pString;
         const Sym* _pSymbol;
-        std::shared_ptr<Scope>* _ppScope;
+        Scope* _pScope;
+        LocalAddress _local;
+        Cell** _ppBinding;
+        CompiledCode* _pCode;
     };
             
-    // Allocator and garbage collector
+    // Allocator and garbage collector, and heap images
     friend CellAllocator;
-    Cell* _pAllocatorNext; 
+    friend HeapImage;
+    friend Resolver;
+
+    enum Immediates
+    {
+        VoidImmediate,
+        EmptyListImmediate,
+        FalseImmediate,
+        TrueImmediate,
+        FirstFixnumImmediate,
+        NumImmediates = FirstFixnumImmediate + (MaxFixnum - MinFixnum + 1)
+    };
+    static Cell ImmediateCells[NumImmediates];
 
 };
 
@@ -23,175 +23,1864 @@
 #include "Cell.h"
 #include "Scope.h"
 
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <xmmintrin.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#define PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#include <sys/mman.h>
+#define PREFETCH(p) __builtin_prefetch(p)
+#endif
+
 namespace Jorvik
 {
 namespace Scheme
 {
 
+// Bit twiddling helpers for the slab bitmaps
+static inline unsigned int LowestBit(uint32_t bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+static inline unsigned int CountBits(uint32_t bits)
+{
+#if defined(_MSC_VER)
+    return __popcnt(bits);
+#else
+    return __builtin_popcount(bits);
+#endif
+}
+
+// Set a bit that other threads may be setting too; returns true if it wasn't already set
+static inline bool AtomicSetBit(uint32_t* pWord, uint32_t bit)
+{
+#if defined(_MSC_VER)
+    return (_InterlockedOr((volatile long*)pWord, (long)bit) & bit) == 0;
+#else
+    return (__atomic_fetch_or(pWord, bit, __ATOMIC_RELAXED) & bit) == 0;
+#endif
+}
+
+// Address space comes from the OS a region at a time.  Regions are aligned to their size and carved into slabs,
+// so slabs are aligned to theirs, and we can find the slab for any cell from its address.
+// A region is 2MB, the size of a huge page.
+static const unsigned int SlabsPerRegion = 32;
+static const size_t RegionSize = size_t(CellAllocator::SlabSize) * SlabsPerRegion;
+static const uint32_t AllSlabs = 0xFFFFFFFF;
+static_assert(SlabsPerRegion == 32, "A region's slabs are tracked in one 32 bit word");
+
+static char* MapRegion()
+{
+#if defined(_MSC_VER)
+    // Find an aligned address by reserving more than we need, then reserve just the aligned part.
+    // Someone else could take it in between, in which case try again.
+    for (;;)
+    {
+        char* pMem = (char*)VirtualAlloc(nullptr, RegionSize * 2, MEM_RESERVE, PAGE_NOACCESS);
+        if (pMem == nullptr)
+        {
+            return nullptr;
+        }
+        char* pAligned = (char*)(((uintptr_t)pMem + RegionSize - 1) & ~(uintptr_t)(RegionSize - 1));
+        VirtualFree(pMem, 0, MEM_RELEASE);
+
+        pMem = (char*)VirtualAlloc(pAligned, RegionSize, MEM_RESERVE, PAGE_NOACCESS);
+        if (pMem != nullptr)
+        {
+            return pMem;
+        }
+    }
+#else
+    // Map more than we need, and trim the ends to leave an aligned region
+    char* pMem = (char*)mmap(nullptr, RegionSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pMem == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    char* pAligned = (char*)(((uintptr_t)pMem + RegionSize - 1) & ~(uintptr_t)(RegionSize - 1));
+    if (pAligned != pMem)
+    {
+        munmap(pMem, pAligned - pMem);
+    }
+    munmap(pAligned + RegionSize, (pMem + RegionSize * 2) - (pAligned + RegionSize));
+    return pAligned;
+#endif
+}
+
+static void UnmapRegion(char* pBase)
+{
+#if defined(_MSC_VER)
+    VirtualFree(pBase, 0, MEM_RELEASE);
+#else
+    munmap(pBase, RegionSize);
+#endif
+}
+
+// Put memory behind a slab's address space before it is used
+static bool CommitSlab(char* pSlab)
+{
+#if defined(_MSC_VER)
+    return VirtualAlloc(pSlab, CellAllocator::SlabSize, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    // Pages are faulted in as they are touched
+    UNUSED(pSlab);
+    return true;
+#endif
+}
+
+// Hand a slab's memory back to the OS, but keep the address space
+static void DiscardSlab(char* pSlab)
+{
+#if defined(_MSC_VER)
+    VirtualFree(pSlab, CellAllocator::SlabSize, MEM_DECOMMIT);
+#else
+    madvise(pSlab, CellAllocator::SlabSize, MADV_DONTNEED);
+#endif
+}
+
+static void AdviseHugePages(char* pBase)
+{
+#if defined(MADV_HUGEPAGE)
+    madvise(pBase, RegionSize, MADV_HUGEPAGE);
+#else
+    UNUSED(pBase);
+#endif
+}
+
+// A region of address space, carved into slabs; one bit per slab.
+// used - the slab has been handed out
+// resident - the slab has memory behind it.  A free one is quick to reuse, but still counts against the process.
+struct CellRegion
+{
+    CellRegion* pNext;
+    char* pBase;
+    uint32_t used;
+    uint32_t resident;
+};
+
+// Cells per slab is a whole number of bitmap words, leaving room for the header and the bitmaps.
+static const unsigned int BitsPerWord = 32;
+static const unsigned int SlabHeaderSize = 64;
+static const unsigned int CellsPerSlab = (((CellAllocator::SlabSize - SlabHeaderSize) * 8 / (sizeof(Cell) * 8 + 3)) / BitsPerWord) * BitsPerWord;
+static const unsigned int BitmapWords = CellsPerSlab / BitsPerWord;
+
+// A slab is one contiguous block of memory; a small header followed by as many cells as will fit.
+// The state of each cell is kept in dense bitmaps in the header, rather than in the cells themselves:
+// allocated - the cell is in use
+// marked - the cell has been reached by the current collection, or is old
+// ownsMemory - the cell owns heap memory that must be freed along with it
+// needsSweep is set for every slab when a full collection finishes marking, and cleared as each is swept.
+// evacuating marks the slabs being copied out of by a compacting collection; in these, a marked cell has
+// been moved, and its car points at the copy.
+// This way the sweep works on whole words of bits, and only touches the cells it frees.
+struct CellSlab
+{
+    CellSlab* pNext;
+    CellRegion* pRegion;
+    unsigned int numLive;
+    uint32_t allocated[BitmapWords];
+    uint32_t marked[BitmapWords];
+    uint32_t ownsMemory[BitmapWords];
+    bool needsSweep;
+    bool evacuating;
+    Cell cells[CellsPerSlab];
+
+    static CellSlab* FromCell(const Cell* pCell)
+    {
+        return (CellSlab*)((uintptr_t)pCell & ~(uintptr_t)(CellAllocator::SlabSize - 1));
+    }
+
+    unsigned int IndexOf(const Cell* pCell) const
+    {
+        return (unsigned int)(pCell - cells);
+    }
+};
+
+static_assert(sizeof(CellSlab) <= CellAllocator::SlabSize, "Slab header and cells must fit in a slab");
+
+// Immediates live outside the slabs, and count as permanently marked
+static inline bool IsMarked(const Cell* pCell)
+{
+    if (Cell::IsImmediate(pCell))
+    {
+        return true;
+    }
+
+    CellSlab* pSlab = CellSlab::FromCell(pCell);
+    unsigned int index = pSlab->IndexOf(pCell);
+    return (pSlab->marked[index / BitsPerWord] & (1u << (index % BitsPerWord))) != 0;
+}
+
+static inline void SetMarked(const Cell* pCell)
+{
+    CellSlab* pSlab = CellSlab::FromCell(pCell);
+    unsigned int index = pSlab->IndexOf(pCell);
+    pSlab->marked[index / BitsPerWord] |= (1u << (index % BitsPerWord));
+}
+
+static inline bool TrySetMarked(const Cell* pCell)
+{
+    if (Cell::IsImmediate(pCell))
+    {
+        return false;
+    }
+
+    CellSlab* pSlab = CellSlab::FromCell(pCell);
+    unsigned int index = pSlab->IndexOf(pCell);
+    return AtomicSetBit(&pSlab->marked[index / BitsPerWord], 1u << (index % BitsPerWord));
+}
+
+// Don't bother with a full collection until the old generation is at least this big
+static const unsigned int MinFullCollectThreshold = CellsPerSlab * 4;
+
+// How often the incremental collector checks the clock; in cells marked
+static const unsigned int MarkCellsPerClockCheck = 256;
+
+// Below these sizes, it isn't worth waking up more threads
+static const unsigned int MinParallelMarkCells = CellsPerSlab * 8;
+static const unsigned int MinParallelSweepSlabs = 8;
+
+// A mark thread shares half its stack once it gets this deep, if the last lot has been taken
+static const unsigned int MarkShareDepth = 64;
+
+typedef std::chrono::steady_clock tClock;
+
+// Adds the time between construction and destruction to the phase's total for the collection, and for the pause
+class PhaseTimer
+{
+public:
+    PhaseTimer(std::chrono::microseconds& total, std::chrono::microseconds& pause)
+        : _total(total),
+        _pause(pause),
+        _start(tClock::now())
+    {
+    }
+    ~PhaseTimer()
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(tClock::now() - _start);
+        _total += elapsed;
+        _pause += elapsed;
+    }
+private:
+    std::chrono::microseconds& _total;
+    std::chrono::microseconds& _pause;
+    tClock::time_point _start;
+};
+
+// Each mark thread works from its own private stack.  When that gets deep, half of it is moved to
+// the shared deque, where idle threads can steal it.
+struct MarkWorker
+{
+    MarkWorker() : sharedSize(0), numMarked(0) {}
+
+    std::vector<Cell*> stack;
+    std::deque<Cell*> shared;
+    std::mutex sharedLock;
+    std::atomic<unsigned int> sharedSize;
+    unsigned int numMarked;
+};
+
 CellAllocator::CellAllocator()
-    : _marked(true),
-    _freeList(nullptr),
-    _allocList(nullptr),
+    : _slabs(nullptr),
+    _slabsTail(nullptr),
+    _allocSlab(nullptr),
+    _allocWord(0),
+    _marked(1),
     _numFreeList(0),
-    _numAllocList(0)
+    _numAllocList(0),
+    _numSlabs(0),
+    _numOld(0),
+    _fullCollectThreshold(MinFullCollectThreshold),
+    _collectThreshold(DefaultCollectThreshold),
+    _allocatedSinceCollect(0),
+    _allocatedDuringCycle(0),
+    _phase(IdlePhase),
+    _sweepSlab(nullptr),
+    _sweepPrevious(nullptr),
+    _pauseBudget(0),
+    _threadCount(1),
+    _markTime(0),
+    _sweepTime(0),
+    _pauseMarkTime(0),
+    _pauseSweepTime(0),
+    _numMarkedCells(0),
+    _liveAfterCollect(0),
+    _lastPause(tClock::now()),
+    _compacting(false),
+    _copyIndex(0),
+    _regions(nullptr),
+    _numRegions(0),
+    _retainedSlabs(DefaultRetainedSlabs),
+    _hugePages(false),
+    _cellLimit(0),
+    _peakAllocList(0),
+    _youngFrames(nullptr),
+    _oldFrames(nullptr),
+    _numFrames(0),
+    _frameDepth(0)
 {
+    ResetStats();
+    Sym::AddCollector(this);
 }
 
 CellAllocator::~CellAllocator()
 {
-    Cell* pFree = _freeList;
-    while (pFree != nullptr)
+    Sym::RemoveCollector(this);
+
+    // Frames hold no cells of their own, only pointers into the slabs
+    ClearRemembered();
+    Scope* pLists[] = { _youngFrames, _oldFrames };
+    for (auto pFrame : pLists)
+    {
+        while (pFrame != nullptr)
+        {
+            Scope* pNext = pFrame->_pNextFrame;
+            delete pFrame;
+            pFrame = pNext;
+        }
+    }
+    for (auto pFrame : _framePool)
+    {
+        delete pFrame;
+    }
+    for (auto pFrame : _frameStack)
     {
-        Cell* pNext = pFree->_pAllocatorNext;
-        delete pFree;
-        pFree = pNext;
+        delete pFrame;
     }
 
-    Cell* pAlloc = _allocList;
-    while (pAlloc != nullptr)
+    // Cells live inside the slabs, so freeing the slabs frees everything
+    CellSlab* pSlab = _slabs;
+    while (pSlab != nullptr)
     {
-        Cell* pNext = pAlloc->_pAllocatorNext;
-        delete pAlloc;
-        pAlloc = pNext;
+        CellSlab* pNext = pSlab->pNext;
+        FreeSlab(pSlab);
+        pSlab = pNext;
     }
 
-    _freeList = nullptr;
-    _allocList = nullptr;
+    _slabs = nullptr;
+    _slabsTail = nullptr;
+    _allocSlab = nullptr;
+
+    while (_regions != nullptr)
+    {
+        CellRegion* pNext = _regions->pNext;
+        UnmapRegion(_regions->pBase);
+        delete _regions;
+        _regions = pNext;
+    }
 }
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL thread_local
+#endif
+
+static THREAD_LOCAL CellAllocator* CurrentHeap = nullptr;
+
 CellAllocator& CellAllocator::Instance()
 {
+    if (CurrentHeap != nullptr)
+    {
+        return *CurrentHeap;
+    }
+
     static CellAllocator alloc;
     return alloc;
 }
 
-// Use the current mark to mark all cells we can reach from this one.
+CellAllocator* CellAllocator::GetCurrent()
+{
+    return CurrentHeap;
+}
+
+void CellAllocator::SetCurrent(CellAllocator* pHeap)
+{
+    CurrentHeap = pHeap;
+}
+
+// Queue a cell for marking.  We start pulling it into the cache now, since it will be needed soon.
 void CellAllocator::Mark(Cell* cell)
 {
-    cell->_mark = _marked;
+    if (cell != nullptr && !Cell::IsImmediate(cell))
+    {
+        PREFETCH(cell);
+        _markStack.push_back(cell);
+    }
+}
+
+// Queue up everything a cell refers to, other than its cdr.
+void CellAllocator::MarkChildren(Cell* cell)
+{
+    Mark(cell->GetCar());
 
-    if (cell->_car)
+    // A closure keeps alive just the frame of values it captured, not the scope it was made in
+    if (cell->GetKind() == Cell::LambdaKind && cell->_pScope)
     {
-        Mark(cell->_car);
+        MarkScope(cell->_pScope);
     }
+}
 
-    if (cell->_cdr)
+// Scopes are marked just like cells, so old scopes are skipped by a young collection.
+// They live outside the slabs, so carry their own mark, which flips sense on each full collection.
+void CellAllocator::MarkScope(Scope* pScope)
+{
+    while (pScope != nullptr && pScope->_mark != _marked)
     {
-        Mark(cell->_cdr);
+        pScope->_mark = _marked;
+        for (auto& var : pScope->_variables)
+        {
+            Mark(var.second);
+        }
+        for (auto pSlot : pScope->_slots)
+        {
+            Mark(pSlot);
+        }
+        pScope = pScope->_pOuter;
     }
 }
 
-// Two strategies currently.
-// We can either immediately delete any orphaned cells, or
-// we can throw them onto a free pool.
-// This means the heap will grow to the maximum required,
-// and then allocation will be fast at the expense of 
-// memory.  Otherwise, it will keep memory free, but cost a bit more per allocation
-void CellAllocator::AddToFreeList(Cell* pCell)
+// Use the current mark to mark all cells we can reach from the queued ones.
+// Anything already marked is either old, or has been visited; in both cases we can stop.
+// Rather than recursing, we loop down the cdr chain, and only push the cars.  So a long list
+// costs no extra stack, and the next cell in the chain is fetched while we deal with this one.
+// In tri-colour terms, unmarked cells are white, cells on the stack are grey, and marked cells are black.
+// If there is a deadline, we stop when we reach it, leaving the rest on the stack, and return false.
+bool CellAllocator::DrainMarkStack(const tClock::time_point* pDeadline)
 {
-#ifdef USE_FREE_LIST
-    if (pCell->_type & DeleteNoGC)
+    // Only full collections are worth sharing out; a young one is bounded by the size of the nursery
+    if (pDeadline == nullptr &&
+        _phase == MarkPhase &&
+        _threadCount > 1 &&
+        _numAllocList >= MinParallelMarkCells)
     {
-        delete pCell;
+        DrainMarkStackParallel();
+        return true;
     }
-    else
+
+    unsigned int count = 0;
+    while (!_markStack.empty())
     {
-        pCell->_pAllocatorNext = _freeList;
-        _freeList = pCell;
-        _numFreeList++;
-        pCell->FreeMemory();
+        Cell* pCell = _markStack.back();
+        _markStack.pop_back();
+
+        while (pCell != nullptr && !IsMarked(pCell))
+        {
+            if (pDeadline != nullptr && 
+                ++count == MarkCellsPerClockCheck)
+            {
+                count = 0;
+                if (tClock::now() >= *pDeadline)
+                {
+                    _markStack.push_back(pCell);
+                    return false;
+                }
+            }
+
+            SetMarked(pCell);
+            _numMarkedCells++;
+
+            Cell* pNext = pCell->GetCdr();
+            if (pNext != nullptr)
+            {
+                PREFETCH(pNext);
+            }
+
+            MarkChildren(pCell);
+            pCell = pNext;
+        }
     }
-#else
-    delete pCell;
-#endif
-    _numAllocList--;
+    return true;
 }
 
-void CellAllocator::GarbageCollect(Scope* pScope)
+// Run a function on each of the collector's threads, including this one, and wait for them all
+void CellAllocator::RunThreads(const std::function<void(unsigned int)>& fn)
 {
-    // Mark globals
-    Mark(Cell::Void());
-    Mark(Cell::EmptyList());
-
-    // Mark all the symbols in the scope.
-    const Scope::tmapSymbolToCell& symbols = pScope->GetSymbols();    
-    for(auto var : symbols)
+    // Scopes freed by a sweep forget themselves from the current heap, so the helpers need it to be this one
+    std::vector<std::thread> threads;
+    for (unsigned int index = 1; index < _threadCount; index++)
     {
-        Mark(var.second);
+        threads.push_back(std::thread([this, &fn](unsigned int index)
+        {
+            HeapScope heap(this);
+            fn(index);
+        }, index));
     }
-
-    // Return all unmarked cells to the free list
-    Cell* pCell = _allocList;
-    while (pCell && pCell->_mark != _marked)
+    fn(0);
+    for (auto& thread : threads)
     {
-        _allocList = pCell->_pAllocatorNext;
-        
-        AddToFreeList(pCell);
-
-        pCell = _allocList;
+        thread.join();
     }
+}
 
-    if (pCell)
+// Deal out the queued cells, and mark everything they reach using all the threads.
+// The mutator is stopped, so the only shared state is the mark bits, which are set atomically.
+// Marking is done when every thread has run out of work, and there is none left to steal.
+void CellAllocator::DrainMarkStackParallel()
+{
+    std::unique_ptr<MarkWorker[]> workers(new MarkWorker[_threadCount]);
+    for (unsigned int index = 0; index < _markStack.size(); index++)
     {
-        Cell* pPrevious = pCell;
-        pCell = pCell->_pAllocatorNext;
+        workers[index % _threadCount].stack.push_back(_markStack[index]);
+    }
+    _markStack.clear();
 
-        while(pCell)
+    std::atomic<unsigned int> active(_threadCount);
+    RunThreads([&](unsigned int index)
+    {
+        MarkWorker& worker = workers[index];
+        for (;;)
         {
-            Cell* pNext = pCell->_pAllocatorNext;
-            if (pCell->_mark != _marked)
+            while (!worker.stack.empty())
             {
-                pPrevious->_pAllocatorNext = pNext;
-                AddToFreeList(pCell);            
+                Cell* pCell = worker.stack.back();
+                worker.stack.pop_back();
+
+                while (pCell != nullptr && TrySetMarked(pCell))
+                {
+                    worker.numMarked++;
+                    Cell* pNext = pCell->GetCdr();
+                    if (pNext != nullptr)
+                    {
+                        PREFETCH(pNext);
+                    }
+
+                    if (pCell->GetCar() != nullptr)
+                    {
+                        worker.stack.push_back(pCell->GetCar());
+                    }
+
+                    if (pCell->GetKind() == Cell::LambdaKind && pCell->_pScope)
+                    {
+                        Scope* pScope = pCell->_pScope;
+                        while (pScope != nullptr && pScope->_mark.exchange(_marked) != _marked)
+                        {
+                            for (auto& var : pScope->_variables)
+                            {
+                                if (var.second != nullptr)
+                                {
+                                    worker.stack.push_back(var.second);
+                                }
+                            }
+                            for (auto pSlot : pScope->_slots)
+                            {
+                                if (pSlot != nullptr)
+                                {
+                                    worker.stack.push_back(pSlot);
+                                }
+                            }
+                            pScope = pScope->_pOuter;
+                        }
+                    }
+                    pCell = pNext;
+                }
+
+                if (worker.stack.size() >= MarkShareDepth && worker.sharedSize == 0)
+                {
+                    std::lock_guard<std::mutex> lock(worker.sharedLock);
+                    unsigned int count = (unsigned int)worker.stack.size() / 2;
+                    worker.shared.insert(worker.shared.end(), worker.stack.begin(), worker.stack.begin() + count);
+                    worker.stack.erase(worker.stack.begin(), worker.stack.begin() + count);
+                    worker.sharedSize = (unsigned int)worker.shared.size();
+                }
             }
-            else
+
+            if (StealMarkWork(workers.get(), index))
             {
-                pPrevious = pCell;
+                continue;
+            }
+
+            // Nothing left here; wait until someone shares more, or everyone is out of work.
+            // A thread only goes idle after failing to find shared work, so when none are active, none is left.
+            active--;
+            for (;;)
+            {
+                if (active == 0)
+                {
+                    return;
+                }
+
+                active++;
+                if (StealMarkWork(workers.get(), index))
+                {
+                    break;
+                }
+                active--;
+                std::this_thread::yield();
             }
-            pCell = pNext;
         }
+    });
+
+    for (unsigned int index = 0; index < _threadCount; index++)
+    {
+        _numMarkedCells += workers[index].numMarked;
     }
+}
+
+// Take half of the first shared work we find, looking at our own first
+bool CellAllocator::StealMarkWork(MarkWorker* pWorkers, unsigned int index)
+{
+    for (unsigned int offset = 0; offset < _threadCount; offset++)
+    {
+        MarkWorker& victim = pWorkers[(index + offset) % _threadCount];
+        if (victim.sharedSize == 0)
+        {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(victim.sharedLock);
+        if (victim.shared.empty())
+        {
+            continue;
+        }
 
-    // Change the mark so we don't have to reset the marks; we flip the sense of what it means 
-    // to be marked each time round.
-    _marked = !_marked;
+        unsigned int count = std::max((unsigned int)victim.shared.size() / 2, 1u);
+        std::vector<Cell*>& stack = pWorkers[index].stack;
+        stack.insert(stack.end(), victim.shared.begin(), victim.shared.begin() + count);
+        victim.shared.erase(victim.shared.begin(), victim.shared.begin() + count);
+        victim.sharedSize = (unsigned int)victim.shared.size();
+        return true;
+    }
+    return false;
 }
 
-Cell& CellAllocator::Alloc()
+void CellAllocator::MarkRoots(Scope* pScope)
 {
-    Cell* pCell;
+    // Mark all the symbols in the scopes.
+    MarkScope(pScope);
+    for (auto pGlobal : _globalScopes)
+    {
+        MarkScope(pGlobal);
+    }
 
-    // Use the first on the free list.
-    if (_freeList != nullptr)
+    // Mark everything the evaluator is holding on to
+    for (auto ppCell : _cellRoots)
     {
-        pCell = _freeList;
-        pCell->_cdr = nullptr;
-        pCell->_car = nullptr;
-        _freeList = _freeList->_pAllocatorNext;
-        _numFreeList--;
+        if (*ppCell)
+        {
+            Mark(*ppCell);
+        }
     }
-    else
+
+    for (auto ppScope : _scopeRoots)
     {
-        pCell = new Cell();
+        MarkScope(*ppScope);
     }
 
-    pCell->_mark = !_marked;
-    
-    pCell->_pAllocatorNext = _allocList;
-    _allocList = pCell;
-    _numAllocList++;
+    for (auto pStack : _stacks)
+    {
+        for (auto pCell : *pStack)
+        {
+            Mark(pCell);
+        }
+    }
+
+    // The frames of the calls in progress
+    for (unsigned int frame = 0; frame < _frameDepth; frame++)
+    {
+        MarkScope(_frameStack[frame]);
+    }
+}
 
-    return *pCell;
+// Anything held by code that is running
+bool CellAllocator::HasLocalRoots() const
+{
+    for (auto pStack : _stacks)
+    {
+        if (!pStack->empty())
+        {
+            return true;
+        }
+    }
+    return !_cellRoots.empty() || !_scopeRoots.empty() || _frameDepth != 0;
 }
 
-unsigned int CellAllocator::GetFreeListSize() const
+void CellAllocator::AddGlobalScope(Scope* pScope)
 {
-    return _numFreeList; 
+    _globalScopes.push_back(pScope);
 }
 
-unsigned int CellAllocator::GetPoolSize() const
+void CellAllocator::RemoveGlobalScope(Scope* pScope)
 {
-    return _numAllocList; 
+    auto itr = std::find(_globalScopes.begin(), _globalScopes.end(), pScope);
+    if (itr != _globalScopes.end())
+    {
+        _globalScopes.erase(itr);
+    }
+}
+
+void CellAllocator::AddStack(std::vector<Cell*>* pStack)
+{
+    _stacks.push_back(pStack);
+}
+
+void CellAllocator::RemoveStack(std::vector<Cell*>* pStack)
+{
+    auto itr = std::find(_stacks.begin(), _stacks.end(), pStack);
+    if (itr != _stacks.end())
+    {
+        _stacks.erase(itr);
+    }
+}
+
+// The write barriers.  
+// While an incremental collection is marking, the new value is shaded grey, so a black cell or scope can
+// never end up pointing at a white cell that we won't otherwise find.
+// The rest of the time, an old cell or scope that is made to point at a young cell is remembered,
+// so that a young collection can find the young cell without tracing the old generation.
+void CellAllocator::WriteBarrier(Cell* pCell, Cell* pValue)
+{
+    if (pValue == nullptr)
+    {
+        return;
+    }
+
+    if (_phase == MarkPhase)
+    {
+        if (!IsMarked(pValue))
+        {
+            Mark(pValue);
+        }
+        return;
+    }
+
+    if (!IsMarked(pCell) ||
+        IsMarked(pValue))
+    {
+        return;
+    }
+    _rememberedCells.push_back(pCell);
+}
+
+void CellAllocator::WriteBarrier(Scope* pScope, Cell* pValue)
+{
+    if (pValue == nullptr)
+    {
+        return;
+    }
+
+    if (_phase == MarkPhase)
+    {
+        if (!IsMarked(pValue))
+        {
+            Mark(pValue);
+        }
+        return;
+    }
+
+    if (pScope->_remembered ||
+        pScope->_mark != _marked ||
+        IsMarked(pValue))
+    {
+        return;
+    }
+    pScope->_remembered = true;
+    pScope->_rememberedIndex = (unsigned int)_rememberedScopes.size();
+    _rememberedScopes.push_back(pScope);
+}
+
+// A remembered scope is going away, so stop tracking it.  Every returning call can get here, so the last
+// scope in the set takes its place, rather than searching for it.
+void CellAllocator::ForgetScope(Scope* pScope)
+{
+    if (!pScope->_remembered)
+    {
+        return;
+    }
+    Scope* pLast = _rememberedScopes.back();
+    _rememberedScopes[pScope->_rememberedIndex] = pLast;
+    pLast->_rememberedIndex = pScope->_rememberedIndex;
+    _rememberedScopes.pop_back();
+    pScope->_remembered = false;
+}
+
+// Marking is over, so any literal that wasn't reached is about to be swept
+void CellAllocator::PruneLiterals()
+{
+    for (auto itr = _literals.begin(); itr != _literals.end();)
+    {
+        if (IsMarked(itr->second))
+        {
+            ++itr;
+        }
+        else
+        {
+            itr = _literals.erase(itr);
+        }
+    }
+}
+
+// Globals that were only ever referred to by code that has gone, and never defined
+void CellAllocator::PruneBindings()
+{
+    for (auto pGlobal : _globalScopes)
+    {
+        pGlobal->PruneBindings();
+    }
+}
+
+Cell* CellAllocator::StringLiteral(const std::string& text)
+{
+    auto itr = _literals.find(text);
+    if (itr != _literals.end())
+    {
+        // It may not have been reached yet, and the only other route to it could already be marked
+        if (_phase == MarkPhase && !IsMarked(itr->second))
+        {
+            Mark(itr->second);
+        }
+        return itr->second;
+    }
+
+    Cell* pCell = Cell::String(text.c_str());
+    _literals[text] = pCell;
+    return pCell;
+}
+
+Scope* CellAllocator::AllocFrame()
+{
+    Scope* pFrame;
+    if (!_framePool.empty())
+    {
+        pFrame = _framePool.back();
+        _framePool.pop_back();
+    }
+    else
+    {
+        pFrame = new Scope();
+    }
+    LinkFrame(pFrame, _youngFrames);
+    _numFrames++;
+    return pFrame;
+}
+
+// Call frames are roots while they are on the stack, and aren't on the frame lists, so the sweep never sees them
+Scope* CellAllocator::PushFrame(Scope* pOuter)
+{
+    if (_frameDepth == _frameStack.size())
+    {
+        _frameStack.push_back(new Scope());
+    }
+    Scope* pFrame = _frameStack[_frameDepth++];
+    pFrame->_pOuter = pOuter;
+    return pFrame;
+}
+
+void CellAllocator::PopFrame()
+{
+    Scope* pFrame = _frameStack[--_frameDepth];
+    if (pFrame->_remembered)
+    {
+        ForgetScope(pFrame);
+    }
+    pFrame->Clear();
+}
+
+void CellAllocator::FreeFrame(Scope* pFrame)
+{
+    UnlinkFrame(pFrame);
+    _numFrames--;
+    if (pFrame->_remembered)
+    {
+        ForgetScope(pFrame);
+    }
+
+    if (_framePool.size() < MaxPooledFrames)
+    {
+        pFrame->Clear();
+        _framePool.push_back(pFrame);
+    }
+    else
+    {
+        delete pFrame;
+    }
+}
+
+void CellAllocator::LinkFrame(Scope* pFrame, Scope*& pList)
+{
+    pFrame->_young = (&pList == &_youngFrames);
+    pFrame->_pPrevFrame = nullptr;
+    pFrame->_pNextFrame = pList;
+    if (pList != nullptr)
+    {
+        pList->_pPrevFrame = pFrame;
+    }
+    pList = pFrame;
+}
+
+void CellAllocator::UnlinkFrame(Scope* pFrame)
+{
+    if (pFrame->_pPrevFrame != nullptr)
+    {
+        pFrame->_pPrevFrame->_pNextFrame = pFrame->_pNextFrame;
+    }
+    else
+    {
+        (pFrame->_young ? _youngFrames : _oldFrames) = pFrame->_pNextFrame;
+    }
+    if (pFrame->_pNextFrame != nullptr)
+    {
+        pFrame->_pNextFrame->_pPrevFrame = pFrame->_pPrevFrame;
+    }
+}
+
+// Marking is over; frames that weren't reached are freed, and the young ones that were are now old.
+// A young collection only leaves the old frames alone, since it doesn't mark them.
+void CellAllocator::SweepFrames(bool full)
+{
+    Scope* pFrame = _youngFrames;
+    while (pFrame != nullptr)
+    {
+        Scope* pNext = pFrame->_pNextFrame;
+        if (pFrame->_mark == _marked)
+        {
+            UnlinkFrame(pFrame);
+            LinkFrame(pFrame, _oldFrames);
+        }
+        else
+        {
+            FreeFrame(pFrame);
+        }
+        pFrame = pNext;
+    }
+
+    if (full)
+    {
+        pFrame = _oldFrames;
+        while (pFrame != nullptr)
+        {
+            Scope* pNext = pFrame->_pNextFrame;
+            if (pFrame->_mark != _marked)
+            {
+                FreeFrame(pFrame);
+            }
+            pFrame = pNext;
+        }
+    }
+}
+
+void CellAllocator::ClearRemembered()
+{
+    for (auto pScope : _rememberedScopes)
+    {
+        pScope->_remembered = false;
+    }
+    _rememberedScopes.clear();
+    _rememberedCells.clear();
+}
+
+// Grab a new, empty slab, and add it to the end of the list so allocation reaches it next.
+void CellAllocator::AllocSlab()
+{
+    CellRegion* pRegion = nullptr;
+    void* pMem = AllocSlabMemory(pRegion);
+
+    CellSlab* pSlab = new (pMem) CellSlab();
+    pSlab->pNext = nullptr;
+    pSlab->pRegion = pRegion;
+    pSlab->numLive = 0;
+    pSlab->needsSweep = false;
+    pSlab->evacuating = false;
+    memset(pSlab->allocated, 0, sizeof(pSlab->allocated));
+    memset(pSlab->marked, 0, sizeof(pSlab->marked));
+    memset(pSlab->ownsMemory, 0, sizeof(pSlab->ownsMemory));
+
+    if (_slabsTail != nullptr)
+    {
+        _slabsTail->pNext = pSlab;
+    }
+    else
+    {
+        _slabs = pSlab;
+    }
+    _slabsTail = pSlab;
+    _numSlabs++;
+    _numFreeList += CellsPerSlab;
+
+    _allocSlab = pSlab;
+    _allocWord = 0;
+}
+
+void CellAllocator::FreeSlab(CellSlab* pSlab)
+{
+    CellRegion* pRegion = pSlab->pRegion;
+    unsigned int slot = (unsigned int)(((char*)pSlab - pRegion->pBase) / SlabSize);
+
+    pSlab->~CellSlab();
+    pRegion->used &= ~(1u << slot);
+}
+
+// Find room for a slab.  A free slab that still has memory behind it is cheapest, then any free
+// slab, and failing that a new region.
+void* CellAllocator::AllocSlabMemory(CellRegion*& pRegion)
+{
+    pRegion = nullptr;
+    for (CellRegion* pCurrent = _regions; pCurrent != nullptr; pCurrent = pCurrent->pNext)
+    {
+        if (~pCurrent->used & pCurrent->resident)
+        {
+            pRegion = pCurrent;
+            break;
+        }
+        if (pRegion == nullptr && pCurrent->used != AllSlabs)
+        {
+            pRegion = pCurrent;
+        }
+    }
+
+    if (pRegion == nullptr)
+    {
+        char* pBase = MapRegion();
+        if (pBase == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        if (_hugePages)
+        {
+            AdviseHugePages(pBase);
+        }
+
+        pRegion = new CellRegion();
+        pRegion->pNext = _regions;
+        pRegion->pBase = pBase;
+        pRegion->used = 0;
+        pRegion->resident = 0;
+        _regions = pRegion;
+        _numRegions++;
+    }
+
+    uint32_t free = ~pRegion->used;
+    uint32_t freeResident = free & pRegion->resident;
+    uint32_t bit = 1u << LowestBit(freeResident != 0 ? freeResident : free);
+    char* pSlab = pRegion->pBase + size_t(LowestBit(bit)) * SlabSize;
+    if (!(pRegion->resident & bit))
+    {
+        if (!CommitSlab(pSlab))
+        {
+            throw std::bad_alloc();
+        }
+        pRegion->resident |= bit;
+    }
+    pRegion->used |= bit;
+    return pSlab;
+}
+
+// Apply the retention policy after a collection.  Up to the retained number of free slabs keep their memory,
+// so that steady allocation doesn't have to go back to the OS; the memory behind any others is given back,
+// along with the address space of any region left with nothing in it.
+void CellAllocator::TrimRegions()
+{
+    unsigned int numRetained = 0;
+    for (CellRegion* pRegion = _regions; pRegion != nullptr; pRegion = pRegion->pNext)
+    {
+        numRetained += CountBits(~pRegion->used & pRegion->resident);
+    }
+
+    unsigned int numExcess = numRetained > _retainedSlabs ? numRetained - _retainedSlabs : 0;
+    CellRegion* pPrevious = nullptr;
+    CellRegion* pRegion = _regions;
+    while (pRegion != nullptr)
+    {
+        CellRegion* pNext = pRegion->pNext;
+        unsigned int numResident = CountBits(pRegion->resident);
+        if (pRegion->used == 0 && numResident <= numExcess)
+        {
+            numExcess -= numResident;
+            UnmapRegion(pRegion->pBase);
+            delete pRegion;
+            _numRegions--;
+
+            if (pPrevious != nullptr)
+            {
+                pPrevious->pNext = pNext;
+            }
+            else
+            {
+                _regions = pNext;
+            }
+            pRegion = pNext;
+            continue;
+        }
+
+        uint32_t discard = ~pRegion->used & pRegion->resident;
+        while (discard != 0 && numExcess != 0)
+        {
+            uint32_t bit = discard & (0 - discard);
+            DiscardSlab(pRegion->pBase + size_t(LowestBit(bit)) * SlabSize);
+            pRegion->resident &= ~bit;
+            discard &= ~bit;
+            numExcess--;
+        }
+
+        pPrevious = pRegion;
+        pRegion = pNext;
+    }
+}
+
+// Walk the bitmaps of a slab, a word at a time.  Only garbage cells which own memory are touched.
+// Touches nothing outside the slab, so slabs can be swept on any thread; returns the number of cells freed.
+unsigned int CellAllocator::SweepSlab(CellSlab* pSlab)
+{
+    unsigned int numFreed = 0;
+
+    pSlab->numLive = 0;
+    for (unsigned int word = 0; word < BitmapWords; word++)
+    {
+        uint32_t live = pSlab->allocated[word] & pSlab->marked[word];
+        uint32_t garbage = pSlab->allocated[word] & ~pSlab->marked[word];
+
+        uint32_t finalize = garbage & pSlab->ownsMemory[word];
+        while (finalize != 0)
+        {
+            pSlab->cells[word * BitsPerWord + LowestBit(finalize)].FreeMemory();
+            finalize &= finalize - 1;
+        }
+
+        pSlab->allocated[word] = live;
+        pSlab->ownsMemory[word] &= live;
+        pSlab->numLive += CountBits(live);
+        numFreed += CountBits(garbage);
+    }
+    pSlab->needsSweep = false;
+    return numFreed;
+}
+
+// Sweep slabs until we are done, or reach the deadline.
+// Slabs the allocator got to first have already been swept, and are in use.  Any slab we sweep
+// that is left without a live cell is returned in bulk.
+bool CellAllocator::SweepSlabs(const tClock::time_point* pDeadline)
+{
+    if (pDeadline == nullptr &&
+        _threadCount > 1 &&
+        _numSlabs >= MinParallelSweepSlabs)
+    {
+        SweepSlabsParallel();
+        return true;
+    }
+
+    while (_sweepSlab != nullptr)
+    {
+        if (pDeadline != nullptr && tClock::now() >= *pDeadline)
+        {
+            return false;
+        }
+
+        CellSlab* pSlab = _sweepSlab;
+        CellSlab* pNext = pSlab->pNext;
+        if (pSlab->needsSweep)
+        {
+            unsigned int numFreed = SweepSlab(pSlab);
+            _numAllocList -= numFreed;
+            _numFreeList += numFreed;
+            if (pSlab->numLive == 0)
+            {
+                ReleaseSweptSlab(pSlab);
+                continue;
+            }
+        }
+        _sweepPrevious = pSlab;
+        _sweepSlab = pNext;
+    }
+    return true;
+}
+
+// Sweep all the remaining slabs, sharing them out between the threads as each one finishes its last
+void CellAllocator::SweepSlabsParallel()
+{
+    std::vector<CellSlab*> slabs;
+    for (CellSlab* pSlab = _sweepSlab; pSlab != nullptr; pSlab = pSlab->pNext)
+    {
+        if (pSlab->needsSweep)
+        {
+            slabs.push_back(pSlab);
+        }
+    }
+
+    std::atomic<unsigned int> next(0);
+    std::atomic<unsigned int> freed(0);
+    RunThreads([&](unsigned int index)
+    {
+        UNUSED(index);
+        unsigned int numFreed = 0;
+        unsigned int slab;
+        while ((slab = next++) < slabs.size())
+        {
+            numFreed += SweepSlab(slabs[slab]);
+        }
+        freed += numFreed;
+    });
+    _numAllocList -= freed;
+    _numFreeList += freed;
+
+    // The slabs we swept are in list order, so hand back the empty ones in a single walk
+    unsigned int slab = 0;
+    while (_sweepSlab != nullptr)
+    {
+        CellSlab* pSlab = _sweepSlab;
+        if (slab < slabs.size() && slabs[slab] == pSlab)
+        {
+            slab++;
+            if (pSlab->numLive == 0)
+            {
+                ReleaseSweptSlab(pSlab);
+                continue;
+            }
+        }
+        _sweepPrevious = pSlab;
+        _sweepSlab = pSlab->pNext;
+    }
+}
+
+// Unlink the slab at the sweep cursor and give it back
+void CellAllocator::ReleaseSweptSlab(CellSlab* pSlab)
+{
+    CellSlab* pNext = pSlab->pNext;
+    if (_sweepPrevious != nullptr)
+    {
+        _sweepPrevious->pNext = pNext;
+    }
+    else
+    {
+        _slabs = pNext;
+    }
+
+    if (_slabsTail == pSlab)
+    {
+        _slabsTail = _sweepPrevious;
+    }
+
+    FreeSlab(pSlab);
+    _numSlabs--;
+    _numFreeList -= CellsPerSlab;
+    _sweepSlab = pNext;
+}
+
+// Free any unmarked cells in the nursery, and promote the rest to the old generation.
+// The cost of this is proportional to the cells allocated since the last collection, not the heap.
+void CellAllocator::SweepNursery()
+{
+    for (auto pCell : _nursery)
+    {
+        if (IsMarked(pCell))
+        {
+            _numOld++;
+            continue;
+        }
+
+        CellSlab* pSlab = CellSlab::FromCell(pCell);
+        unsigned int index = pSlab->IndexOf(pCell);
+        uint32_t bit = 1u << (index % BitsPerWord);
+        if (pSlab->ownsMemory[index / BitsPerWord] & bit)
+        {
+            pCell->FreeMemory();
+            pSlab->ownsMemory[index / BitsPerWord] &= ~bit;
+        }
+        pSlab->allocated[index / BitsPerWord] &= ~bit;
+
+        _numFreeList++;
+        _numAllocList--;
+    }
+    _nursery.clear();
+}
+
+// Trace from the roots and the remembered set, only visiting young cells.
+void CellAllocator::CollectYoung(Scope* pScope)
+{
+    _markTime = _sweepTime = std::chrono::microseconds(0);
+    {
+        PhaseTimer timer(_markTime, _pauseMarkTime);
+        MarkRoots(pScope);
+
+        for (auto pCell : _rememberedCells)
+        {
+            MarkChildren(pCell);
+            Mark(pCell->GetCdr());
+        }
+
+        for (auto pRemembered : _rememberedScopes)
+        {
+            for (auto& var : pRemembered->_variables)
+            {
+                Mark(var.second);
+            }
+            for (auto pSlot : pRemembered->_slots)
+            {
+                Mark(pSlot);
+            }
+        }
+        DrainMarkStack();
+    }
+
+    PhaseTimer timer(_sweepTime, _pauseSweepTime);
+    PruneLiterals();
+    SweepFrames(false);
+    SweepNursery();
+    ClearRemembered();
+}
+
+// Begin a full collection; everything counts as unmarked again until it is reached.
+// Every cell will be traced or swept by this collection, so the nursery and remembered set are no longer needed.
+void CellAllocator::BeginCycle(Scope* pScope)
+{
+    _markTime = _sweepTime = std::chrono::microseconds(0);
+    PhaseTimer timer(_markTime, _pauseMarkTime);
+
+    // For scopes we flip the sense of what it means to be marked, so we don't have to find them all.
+    _marked = (_marked == 1) ? 2 : 1;
+    for (CellSlab* pSlab = _slabs; pSlab != nullptr; pSlab = pSlab->pNext)
+    {
+        memset(pSlab->marked, 0, sizeof(pSlab->marked));
+    }
+
+    _nursery.clear();
+    ClearRemembered();
+
+    _phase = MarkPhase;
+    _allocatedDuringCycle = 0;
+    MarkRoots(pScope);
+}
+
+// The grey set is empty, but the roots aren't covered by the barriers, so go round them again.
+// This part isn't incremental, but only costs as much as the roots and anything new they point at.
+// Then get ready to sweep.
+void CellAllocator::FinishMarking(Scope* pScope)
+{
+    MarkRoots(pScope);
+    DrainMarkStack();
+    PruneLiterals();
+    SweepFrames(true);
+
+    for (CellSlab* pSlab = _slabs; pSlab != nullptr; pSlab = pSlab->pNext)
+    {
+        pSlab->needsSweep = true;
+    }
+    _sweepSlab = _slabs;
+    _sweepPrevious = nullptr;
+    _phase = SweepPhase;
+}
+
+// Every cell that referred to a dead symbol has now been swept
+void CellAllocator::EndCycle()
+{
+    PruneBindings();
+    Sym::Collect(this);
+    _phase = IdlePhase;
+    _numOld = _numAllocList - (unsigned int)_nursery.size();
+    _fullCollectThreshold = std::max(_numOld * 2, MinFullCollectThreshold);
+}
+
+// Do a bounded amount of the current full collection.
+void CellAllocator::CycleStep(Scope* pScope)
+{
+    tClock::time_point deadline = tClock::now() + std::chrono::microseconds(_pauseBudget);
+
+    if (_phase == MarkPhase)
+    {
+        PhaseTimer timer(_markTime, _pauseMarkTime);
+        if (!DrainMarkStack(&deadline))
+        {
+            return;
+        }
+        FinishMarking(pScope);
+    }
+
+    PhaseTimer timer(_sweepTime, _pauseSweepTime);
+    if (SweepSlabs(&deadline))
+    {
+        EndCycle();
+    }
+}
+
+// Do whatever is left of the current full collection in one go.
+void CellAllocator::FinishCycle(Scope* pScope)
+{
+    if (_phase == MarkPhase)
+    {
+        PhaseTimer timer(_markTime, _pauseMarkTime);
+        DrainMarkStack();
+        FinishMarking(pScope);
+    }
+
+    PhaseTimer timer(_sweepTime, _pauseSweepTime);
+    SweepSlabs();
+    EndCycle();
+}
+
+// Trace and sweep everything.
+void CellAllocator::CollectFull(Scope* pScope)
+{
+    BeginCycle(pScope);
+    FinishCycle(pScope);
+}
+
+// Move a cell into the to-space, along with the rest of the list after it, so that the spine ends up
+// in consecutive cells.  The cars are left pointing at the old cells, to be fixed up by the scan.
+// Returns where the cell now lives.
+Cell* CellAllocator::Evacuate(Cell* pCell)
+{
+    Cell* pFirst = nullptr;
+    Cell** ppLink = &pFirst;
+    while (pCell != nullptr && !Cell::IsImmediate(pCell) && CellSlab::FromCell(pCell)->evacuating)
+    {
+        // Already moved; just link to the copy
+        if (IsMarked(pCell))
+        {
+            pCell = pCell->GetCar();
+            break;
+        }
+
+        if (_copyIndex == CellsPerSlab)
+        {
+            AllocSlab();
+            _copyIndex = 0;
+        }
+
+        CellSlab* pFrom = CellSlab::FromCell(pCell);
+        unsigned int fromIndex = pFrom->IndexOf(pCell);
+        uint32_t fromBit = 1u << (fromIndex % BitsPerWord);
+
+        CellSlab* pTo = _slabsTail;
+        unsigned int toIndex = _copyIndex++;
+        uint32_t toBit = 1u << (toIndex % BitsPerWord);
+
+        Cell* pCopy = &pTo->cells[toIndex];
+        memcpy((void*)pCopy, (const void*)pCell, sizeof(Cell));
+        pTo->allocated[toIndex / BitsPerWord] |= toBit;
+        pTo->marked[toIndex / BitsPerWord] |= toBit;
+        if (pFrom->ownsMemory[fromIndex / BitsPerWord] & fromBit)
+        {
+            pTo->ownsMemory[toIndex / BitsPerWord] |= toBit;
+        }
+        pTo->numLive++;
+        _numFreeList--;
+        _numAllocList++;
+        _numMarkedCells++;
+
+        // Leave a forwarding pointer behind; anything the cell owned now belongs to the copy
+        pFrom->marked[fromIndex / BitsPerWord] |= fromBit;
+        pCell->Set(Cell::FreeKind, pCopy);
+
+        // Compiled code points at cells that are moving, so it is dropped, and compiled again when it is needed
+        if (pCopy->GetKind() == Cell::CodeKind)
+        {
+            pCopy->FreeMemory();
+        }
+
+        *ppLink = pCopy;
+        if (pCopy->GetKind() != Cell::PairKind)
+        {
+            return pFirst;
+        }
+        ppLink = &pCopy->_cdr;
+        pCell = pCopy->_cdr;
+    }
+    *ppLink = pCell;
+    return pFirst;
+}
+
+void CellAllocator::EvacuateScope(Scope* pScope)
+{
+    while (pScope != nullptr && pScope->_mark != _marked)
+    {
+        pScope->_mark = _marked;
+        for (auto& var : pScope->_variables)
+        {
+            var.second = Evacuate(var.second);
+        }
+        for (auto& pSlot : pScope->_slots)
+        {
+            pSlot = Evacuate(pSlot);
+        }
+        pScope = pScope->_pOuter;
+    }
+}
+
+// A Cheney style copying collection.  The live cells are copied into fresh slabs, which are then scanned 
+// in order, copying whatever the copies point at; the scan is done when it catches up with the copying.
+// Lists are copied cdr first, so the old slabs are left behind completely, along with any fragmentation.
+// Every pointer to a cell must be updated, so this only runs when all of them are known: from the
+// top level, with nothing on the root stack.
+void CellAllocator::CollectCopying(Scope* pScope)
+{
+    _markTime = _sweepTime = std::chrono::microseconds(0);
+
+    CellSlab* pFromSlabs = _slabs;
+    {
+        PhaseTimer timer(_markTime, _pauseMarkTime);
+
+        _marked = (_marked == 1) ? 2 : 1;
+        for (CellSlab* pSlab = pFromSlabs; pSlab != nullptr; pSlab = pSlab->pNext)
+        {
+            memset(pSlab->marked, 0, sizeof(pSlab->marked));
+            pSlab->evacuating = true;
+        }
+        _nursery.clear();
+        ClearRemembered();
+
+        _slabs = _slabsTail = nullptr;
+        _numSlabs = _numFreeList = _numAllocList = 0;
+        _copyIndex = CellsPerSlab;
+
+        EvacuateScope(pScope);
+        for (auto pGlobal : _globalScopes)
+        {
+            EvacuateScope(pGlobal);
+        }
+
+        CellSlab* pScanSlab = _slabs;
+        unsigned int scanIndex = 0;
+        while (pScanSlab != nullptr)
+        {
+            if (scanIndex == (pScanSlab == _slabsTail ? _copyIndex : CellsPerSlab))
+            {
+                if (pScanSlab == _slabsTail)
+                {
+                    break;
+                }
+                pScanSlab = pScanSlab->pNext;
+                scanIndex = 0;
+                continue;
+            }
+
+            Cell* pCell = &pScanSlab->cells[scanIndex++];
+            pCell->SetCar(Evacuate(pCell->GetCar()));
+            if (pCell->GetKind() == Cell::LambdaKind && pCell->_pScope)
+            {
+                EvacuateScope(pCell->_pScope);
+            }
+        }
+    }
+
+    // Literals that were moved follow their copies, and the rest are garbage
+    PhaseTimer timer(_sweepTime, _pauseSweepTime);
+    for (auto itr = _literals.begin(); itr != _literals.end();)
+    {
+        if (IsMarked(itr->second))
+        {
+            itr->second = itr->second->GetCar();
+            ++itr;
+        }
+        else
+        {
+            itr = _literals.erase(itr);
+        }
+    }
+
+    // Anything left behind that wasn't moved is garbage
+    while (pFromSlabs != nullptr)
+    {
+        CellSlab* pNext = pFromSlabs->pNext;
+        for (unsigned int word = 0; word < BitmapWords; word++)
+        {
+            uint32_t finalize = pFromSlabs->allocated[word] & ~pFromSlabs->marked[word] & pFromSlabs->ownsMemory[word];
+            while (finalize != 0)
+            {
+                pFromSlabs->cells[word * BitsPerWord + LowestBit(finalize)].FreeMemory();
+                finalize &= finalize - 1;
+            }
+        }
+        FreeSlab(pFromSlabs);
+        pFromSlabs = pNext;
+    }
+
+    SweepFrames(true);
+    _numOld = _numAllocList;
+    _fullCollectThreshold = std::max(_numOld * 2, MinFullCollectThreshold);
+    PruneBindings();
+    Sym::Collect(this);
+}
+
+// With a pause budget, a full collection is spread over many calls, each doing at most that much work.
+// If the program allocates too much before it finishes, we give up on being incremental and finish it.
+// When compacting, a full collection from the top level copies instead; safe points never move cells.
+void CellAllocator::GarbageCollect(Scope* pScope, bool full)
+{
+    tClock::time_point start = tClock::now();
+    unsigned int allocated = _allocatedSinceCollect;
+    _pauseMarkTime = _pauseSweepTime = std::chrono::microseconds(0);
+    _numMarkedCells = 0;
+    _allocatedSinceCollect = 0;
+
+    if (_compacting &&
+        pScope != nullptr &&
+        !HasLocalRoots() &&
+        (full || _numOld >= _fullCollectThreshold))
+    {
+        if (_phase != IdlePhase)
+        {
+            FinishCycle(pScope);
+        }
+        CollectCopying(pScope);
+    }
+    else if (_phase != IdlePhase)
+    {
+        if (full || _allocatedDuringCycle >= _fullCollectThreshold)
+        {
+            FinishCycle(pScope);
+        }
+        else
+        {
+            CycleStep(pScope);
+        }
+    }
+    else if (full || _numOld >= _fullCollectThreshold)
+    {
+        if (full || _pauseBudget == 0)
+        {
+            CollectFull(pScope);
+        }
+        else
+        {
+            BeginCycle(pScope);
+            CycleStep(pScope);
+        }
+    }
+    else
+    {
+        CollectYoung(pScope);
+    }
+
+    // Start looking for free cells from the beginning again
+    _allocSlab = _slabs;
+    _allocWord = 0;
+
+    TrimRegions();
+    RecordPause(start, allocated);
+}
+
+// Add the collection just made to the stats.  Freed cells are worked out from the change in the live count,
+// so they include any the allocator swept lazily since the last pause.
+void CellAllocator::RecordPause(const tClock::time_point& start, unsigned int allocated)
+{
+    tClock::time_point end = tClock::now();
+    unsigned int pauseTime = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    unsigned int expected = _liveAfterCollect + allocated;
+
+    _stats.markTime = (unsigned int)_pauseMarkTime.count();
+    _stats.sweepTime = (unsigned int)_pauseSweepTime.count();
+    _stats.pauseTime = pauseTime;
+    _stats.interval = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(start - _lastPause).count();
+    _stats.cellsMarked = _numMarkedCells;
+    _stats.cellsFreed = expected > _numAllocList ? expected - _numAllocList : 0;
+    _stats.bytesAllocated = uint64_t(allocated) * sizeof(Cell);
+
+    _stats.pauses++;
+    _stats.maxPauseTime = std::max(_stats.maxPauseTime, pauseTime);
+    _stats.totalPauseTime += pauseTime;
+    _stats.totalCellsMarked += _stats.cellsMarked;
+    _stats.totalCellsFreed += _stats.cellsFreed;
+    _stats.totalBytesAllocated += _stats.bytesAllocated;
+
+    unsigned int bucket = 0;
+    while (bucket < GCStats::PauseBuckets - 1 && pauseTime >= (1u << bucket))
+    {
+        bucket++;
+    }
+    _stats.pauseHistogram[bucket]++;
+
+    _liveAfterCollect = _numAllocList;
+    _lastPause = end;
+}
+
+void CellAllocator::ResetStats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+// The heap has reached its limit at a safe point; see if a full collection makes room.
+void CellAllocator::CollectToLimit()
+{
+    GarbageCollect(nullptr, true);
+    if (_numAllocList >= _cellLimit)
+    {
+        throw heap_limit_error("Out of memory: heap cell limit reached");
+    }
+}
+
+// Find the next free cell by scanning the allocation bitmaps, a word at a time.
+// Slabs still waiting for the sweeper are swept first.
+// Cells allocated while marking are left white, and found through the roots like anything else.  They
+// belong to the collection in progress, so they don't go in the nursery.
+Cell& CellAllocator::Alloc(bool ownsMemory)
+{
+    if (_cellLimit != 0 && _numAllocList >= _cellLimit * 2)
+    {
+        throw heap_limit_error("Out of memory: heap cell limit exceeded between collections");
+    }
+
+    for (;;)
+    {
+        // Carve out a new slab when we run dry
+        if (_allocSlab == nullptr)
+        {
+            AllocSlab();
+        }
+
+        if (_allocSlab->needsSweep)
+        {
+            unsigned int numFreed = SweepSlab(_allocSlab);
+            _numAllocList -= numFreed;
+            _numFreeList += numFreed;
+        }
+
+        while (_allocWord < BitmapWords)
+        {
+            uint32_t freeBits = ~_allocSlab->allocated[_allocWord];
+            if (freeBits != 0)
+            {
+                unsigned int index = _allocWord * BitsPerWord + LowestBit(freeBits);
+                uint32_t bit = 1u << (index % BitsPerWord);
+                _allocSlab->allocated[_allocWord] |= bit;
+                if (ownsMemory)
+                {
+                    _allocSlab->ownsMemory[_allocWord] |= bit;
+                }
+
+                Cell* pCell = &_allocSlab->cells[index];
+                pCell->_head = 0;
+                pCell->_cdr = nullptr;
+    
+                if (_phase != MarkPhase)
+                {
+                    _nursery.push_back(pCell);
+                }
+                if (_phase != IdlePhase)
+                {
+                    _allocatedDuringCycle++;
+                }
+                _allocatedSinceCollect++;
+                _numFreeList--;
+                _numAllocList++;
+                if (_numAllocList > _peakAllocList)
+                {
+                    _peakAllocList = _numAllocList;
+                }
+
+                return *pCell;
+            }
+            _allocWord++;
+        }
+
+        _allocSlab = _allocSlab->pNext;
+        _allocWord = 0;
+    }
+}
+
+unsigned int CellAllocator::GetFreeListSize() const
+{
+    return _numFreeList; 
+}
+
+unsigned int CellAllocator::GetPoolSize() const
+{
+    return _numAllocList; 
+}
+
+unsigned int CellAllocator::GetSlabCount() const
+{
+    return _numSlabs;
+}
+
+unsigned int CellAllocator::GetCellsPerSlab() const
+{
+    return CellsPerSlab;
+}
+
+unsigned int CellAllocator::GetNurserySize() const
+{
+    return (unsigned int)_nursery.size();
+}
+
+void CellAllocator::SetPauseBudget(unsigned int microseconds)
+{
+    _pauseBudget = microseconds;
+}
+
+unsigned int CellAllocator::GetPauseBudget() const
+{
+    return _pauseBudget;
+}
+
+bool CellAllocator::IsCollecting() const
+{
+    return _phase != IdlePhase;
+}
+
+void CellAllocator::SetThreadCount(unsigned int threads)
+{
+    _threadCount = std::max(threads, 1u);
+}
+
+unsigned int CellAllocator::GetThreadCount() const
+{
+    return _threadCount;
+}
+
+void CellAllocator::SetRetainedSlabs(unsigned int slabs)
+{
+    _retainedSlabs = slabs;
+}
+
+unsigned int CellAllocator::GetRetainedSlabs() const
+{
+    return _retainedSlabs;
+}
+
+void CellAllocator::SetHugePages(bool hugePages)
+{
+    _hugePages = hugePages;
+}
+
+bool CellAllocator::GetHugePages() const
+{
+    return _hugePages;
+}
+
+unsigned int CellAllocator::GetRegionCount() const
+{
+    return _numRegions;
+}
+
+unsigned int CellAllocator::GetResidentSlabCount() const
+{
+    unsigned int numResident = 0;
+    for (CellRegion* pRegion = _regions; pRegion != nullptr; pRegion = pRegion->pNext)
+    {
+        numResident += CountBits(pRegion->resident);
+    }
+    return numResident;
+}
+
+void CellAllocator::SetCompacting(bool compacting)
+{
+    _compacting = compacting;
+}
+
+bool CellAllocator::GetCompacting() const
+{
+    return _compacting;
+}
+
+unsigned int CellAllocator::GetMarkTime() const
+{
+    return (unsigned int)_markTime.count();
+}
+
+unsigned int CellAllocator::GetSweepTime() const
+{
+    return (unsigned int)_sweepTime.count();
 }
 
 } // Scheme
@@ -27,40 +27,394 @@ namespace Scheme
 
 class Cell;
 class Scope;
+struct CellSlab;
+struct CellRegion;
+struct MarkWorker;
 
-// A simple allocator, and a mark & sweep garbage collector.
+// Thrown when a heap runs out of room under its cell limit.  The evaluation in progress is abandoned, but
+// the heap is left fit for use, and its garbage is reclaimed by the next collection.
+class heap_limit_error : public std::runtime_error
+{
+public:
+    heap_limit_error(const char* pszError)
+        : runtime_error(pszError)
+    {
+    }
+};
+
+// What the collector has been doing, for monitoring and for tuning the thresholds.
+// Each GarbageCollect call is one pause; an incremental full collection is spread over several.
+struct GCStats
+{
+    // Pauses are counted in power of two buckets: under 1us, under 2us, under 4us, ..., and the last takes the rest
+    static const unsigned int PauseBuckets = 24;
+
+    // The last pause.  Times are in microseconds; frees and allocations are since the pause before.
+    unsigned int markTime;
+    unsigned int sweepTime;
+    unsigned int pauseTime;
+    unsigned int interval;
+    unsigned int cellsMarked;
+    unsigned int cellsFreed;
+    uint64_t bytesAllocated;
+
+    // Totals since the stats were reset
+    unsigned int pauses;
+    unsigned int maxPauseTime;
+    uint64_t totalPauseTime;
+    uint64_t totalCellsMarked;
+    uint64_t totalCellsFreed;
+    uint64_t totalBytesAllocated;
+    unsigned int pauseHistogram[PauseBuckets];
+};
+
+// A simple slab allocator, and a generational mark & sweep garbage collector.
+// Cells are carved out of large contiguous slabs, and each slab keeps bitmaps recording which of its cells
+// are allocated and marked; allocation finds the next free bit.  A slab that has no live cells left after a 
+// collection is handed back in one go.
 // The garbage collector marks all 'in use' cells, and references to other cells.
 // It then frees any cells that aren't marked.
-// This GC has the limitation that it can only run after all expressions have been evaluated.
-// It cannot run during execution of parse/interpret/tokenize, unless extra defence is added to 'dangling'
-// cells which wouldn't get marked.
-// For my purposes this is acceptable, but YMMV.
+// Marks are 'sticky': a cell that survives a collection stays marked, and is considered old.
+// Cells get their mark bit cleared for a full collection; scopes get a young mark when created, which is neither
+// of the two marks that a scope flips between on each full collection.
+// A young collection only traces and sweeps cells allocated since the last collection, stopping at old ones.
+// Old cells and scopes which are changed to point at young cells are caught by the write barriers
+// and remembered, so they can act as extra roots.  A full collection traces everything, and happens
+// when the old generation has grown enough to be worth it.
+// The roots are the registered global scopes, along with any cells and scopes held in C++ locals by the 
+// tokenizer, parser and interpreter, which are pushed on a root stack using CellRoot/ScopeRoot.
+// Allocation never collects; instead the evaluator calls SafePoint() at places where everything live is rooted,
+// and a collection happens there once enough cells have been allocated.  This keeps the heap bounded during
+// long running expressions.
+// Given a pause budget, a full collection is incremental: the roots are greyed, and then each safe point
+// marks or sweeps for at most that long.  While marking, the write barriers grey any cell stored into the heap,
+// and new cells are allocated white; the roots are scanned again before sweeping.  Slabs are swept lazily, by the 
+// allocator or by the next step, whichever reaches them first.
+// Stop-the-world marking and sweeping of a large heap can be spread across several threads.  Mark threads
+// set the mark bits atomically, and steal work from each other's deques; sweep threads take a slab at a time.
+// Optionally, full collections made between evaluations copy the live cells into new slabs instead, following
+// each list's cdr first so that its spine ends up contiguous.
+// Frames are owned by the heap too.  Closures copy what they capture, so a call's frame can't outlive the call;
+// it comes off a stack, and is popped on return.  The frames holding closures' captured values are kept on a list
+// for each generation, freed by the sweep of their generation once nothing reaches them, and recycled through
+// a pool.
 class CellAllocator
 {
 public:
+    // Bytes in each slab of cells
+    static const unsigned int SlabSize = 64 * 1024;
+
+    // Mark of a freshly allocated scope; never the same as the current mark
+    static const unsigned char YoungMark = 0;
+
+    // Frames kept for reuse, at most
+    static const unsigned int MaxPooledFrames = 1024;
+
+    // Cells allocated between collections at safe points, unless changed
+    static const unsigned int DefaultCollectThreshold = 256 * 1024;
+
+    // Free slabs that keep their memory after a collection, unless changed
+    static const unsigned int DefaultRetainedSlabs = 64;
+
     CellAllocator();
     ~CellAllocator();
 
+    // The heap cells are allocated from; that of the evaluator running on this thread.
+    // With no evaluator current, a shared default heap is used.
     static CellAllocator& Instance();
-    void GarbageCollect(Scope* pScope);
+    static CellAllocator* GetCurrent();
+    static void SetCurrent(CellAllocator* pHeap);
+    void GarbageCollect(Scope* pScope, bool full = false);
+
+    // Cells which own heap memory (strings, etc.) must say so, so that it is freed along with them
+    Cell& Alloc(bool ownsMemory = false);
+
+    // A string literal, shared with every other use of the same text.  The pool doesn't keep them alive;
+    // a literal is dropped from it when it is collected.
+    Cell* StringLiteral(const std::string& text);
+    unsigned int GetLiteralCount() const { return (unsigned int)_literals.size(); }
+
+    // A frame for a closure's captured values, which the collector frees once the closure has gone
+    Scope* AllocFrame();
+    unsigned int GetFrameCount() const { return _numFrames; }
 
-    Cell& Alloc();
+    // A frame for a call, inside the values its closure captured.  Popped in order; the stack's frames are kept
+    // for reuse.
+    Scope* PushFrame(Scope* pOuter);
+    void PopFrame();
+    unsigned int GetFrameStackDepth() const { return _frameDepth; }
+
+    // Called where all live cells are rooted; collects if the heap has grown past the threshold.
+    // While an incremental collection is running, it is stepped every slab's worth of allocations instead.
+    void SafePoint() 
+    { 
+        if (_collectThreshold != 0 && 
+            _allocatedSinceCollect >= (_phase == IdlePhase ? _collectThreshold : GetCellsPerSlab())) 
+        {
+            GarbageCollect(nullptr);
+        }
+        if (_cellLimit != 0 && _numAllocList >= _cellLimit)
+        {
+            CollectToLimit();
+        }
+    }
+
+    // Most cells the heap may hold; 0 means no limit.  A safe point that finds the heap at its limit does a
+    // full collection, and throws heap_limit_error if that doesn't bring it back under.  Nothing can be
+    // collected between safe points, so there allocation is stopped outright at twice the limit.
+    void SetCellLimit(unsigned int cells) { _cellLimit = cells; }
+    unsigned int GetCellLimit() const { return _cellLimit; }
+
+    // Most cells in use at once since the last reset
+    unsigned int GetPeakPoolSize() const { return _peakAllocList; }
+    void ResetPeakPoolSize() { _peakAllocList = _numAllocList; }
+    void SetCollectThreshold(unsigned int cells) { _collectThreshold = cells; }
+    unsigned int GetCollectThreshold() const { return _collectThreshold; }
+
+    // Longest pause for a step of a full collection, in microseconds; 0 means stop the world
+    void SetPauseBudget(unsigned int microseconds);
+    unsigned int GetPauseBudget() const;
+    bool IsCollecting() const;
+
+    // Threads used to mark and sweep during stop-the-world collections, including the caller's
+    void SetThreadCount(unsigned int threads);
+    unsigned int GetThreadCount() const;
+
+    // Memory comes from the OS in regions of slabs.  After each collection, free slabs beyond the retained number
+    // give their memory back.  Huge pages can be asked for when a region is mapped, where the OS supports them.
+    void SetRetainedSlabs(unsigned int slabs);
+    unsigned int GetRetainedSlabs() const;
+    void SetHugePages(bool hugePages);
+    bool GetHugePages() const;
+    unsigned int GetRegionCount() const;
+    unsigned int GetResidentSlabCount() const;
+
+    // Compact the heap with a copying collector, for full collections made from the top level, with a scope 
+    // and nothing on the root stack.  Cells move, so the caller mustn't be holding on to any.
+    void SetCompacting(bool compacting);
+    bool GetCompacting() const;
+
+    // Time spent in each phase of the last collection, in microseconds; summed over the steps of an incremental one
+    unsigned int GetMarkTime() const;
+    unsigned int GetSweepTime() const;
+
+    // Telemetry, updated after every collection
+    const GCStats& GetStats() const { return _stats; }
+    void ResetStats();
+
+    // Roots.  Global scopes and the virtual machine's stacks of values are registered for their lifetime,
+    // locals are pushed and popped in order.  Frames on the heap's stack are roots too.
+    void AddGlobalScope(Scope* pScope);
+    void RemoveGlobalScope(Scope* pScope);
+    void AddStack(std::vector<Cell*>* pStack);
+    void RemoveStack(std::vector<Cell*>* pStack);
+    void PushRoot(Cell** ppCell) { _cellRoots.push_back(ppCell); }
+    void PopRoot() { _cellRoots.pop_back(); }
+    void PushRoot(Scope** ppScope) { _scopeRoots.push_back(ppScope); }
+    void PopScopeRoot() { _scopeRoots.pop_back(); }
+
+    // Write barriers; called whenever a cell or scope is changed to point at another cell
+    void WriteBarrier(Cell* pCell, Cell* pValue);
+    void WriteBarrier(Scope* pScope, Cell* pValue);
+
+    // Scopes take part in the generations, but live outside the slabs
+    void ForgetScope(Scope* pScope);
 
     unsigned int GetFreeListSize() const;
     unsigned int GetPoolSize() const; 
+    unsigned int GetSlabCount() const;
+    unsigned int GetCellsPerSlab() const;
+    unsigned int GetNurserySize() const;
 
 private:
     void Mark(Cell* pCell);
-    void AddToFreeList(Cell* pCell);
+    void MarkChildren(Cell* pCell);
+    void MarkScope(Scope* pScope);
+    void MarkRoots(Scope* pScope);
+    bool HasLocalRoots() const;
+    bool DrainMarkStack(const std::chrono::steady_clock::time_point* pDeadline = nullptr);
+    void DrainMarkStackParallel();
+    bool StealMarkWork(MarkWorker* pWorkers, unsigned int index);
+    void RunThreads(const std::function<void(unsigned int)>& fn);
+    void CollectYoung(Scope* pScope);
+    void CollectFull(Scope* pScope);
+    void BeginCycle(Scope* pScope);
+    void FinishMarking(Scope* pScope);
+    void CycleStep(Scope* pScope);
+    void FinishCycle(Scope* pScope);
+    void EndCycle();
+    unsigned int SweepSlab(CellSlab* pSlab);
+    bool SweepSlabs(const std::chrono::steady_clock::time_point* pDeadline = nullptr);
+    void SweepSlabsParallel();
+    void ReleaseSweptSlab(CellSlab* pSlab);
+    Cell* Evacuate(Cell* pCell);
+    void EvacuateScope(Scope* pScope);
+    void CollectCopying(Scope* pScope);
+    void SweepNursery();
+    void ClearRemembered();
+    void PruneLiterals();
+    void PruneBindings();
+    void SweepFrames(bool full);
+    void FreeFrame(Scope* pFrame);
+    void LinkFrame(Scope* pFrame, Scope*& pList);
+    void UnlinkFrame(Scope* pFrame);
+    void CollectToLimit();
+    void RecordPause(const std::chrono::steady_clock::time_point& start, unsigned int allocated);
+    void AllocSlab();
+    void FreeSlab(CellSlab* pSlab);
+    void* AllocSlabMemory(CellRegion*& pRegion);
+    void TrimRegions();
 
 private:
-    Cell* _allocList;
-    Cell* _freeList;
+    enum Phase
+    {
+        IdlePhase,
+        MarkPhase,
+        SweepPhase
+    };
+
+    CellSlab* _slabs;
+    CellSlab* _slabsTail;
+
+    // Where to look for the next free cell
+    CellSlab* _allocSlab;
+    unsigned int _allocWord;
+
+    // Cells allocated since the last collection
+    std::vector<Cell*> _nursery;
+
+    // Cells waiting to be marked; grows as needed, and keeps its size between collections
+    std::vector<Cell*> _markStack;
+
+    // Old cells & scopes that may point at young cells
+    std::vector<Cell*> _rememberedCells;
+    std::vector<Scope*> _rememberedScopes;
 
-    bool _marked;
+    // Roots
+    std::vector<Scope*> _globalScopes;
+    std::vector<Cell**> _cellRoots;
+    std::vector<Scope**> _scopeRoots;
+    std::vector<std::vector<Cell*>*> _stacks;
+
+    // Current mark for scopes
+    unsigned char _marked;
     unsigned int _numFreeList;
     unsigned int _numAllocList;
+    unsigned int _numSlabs;
+    unsigned int _numOld;
+    unsigned int _fullCollectThreshold;
+    unsigned int _collectThreshold;
+    unsigned int _allocatedSinceCollect;
+    unsigned int _allocatedDuringCycle;
+
+    // Incremental full collection
+    Phase _phase;
+    CellSlab* _sweepSlab;
+    CellSlab* _sweepPrevious;
+    unsigned int _pauseBudget;
+
+    // Parallel collection, and timing
+    unsigned int _threadCount;
+    std::chrono::microseconds _markTime;
+    std::chrono::microseconds _sweepTime;
+
+    // Telemetry; the time each phase took in the current pause, and the cells marked in it
+    GCStats _stats;
+    std::chrono::microseconds _pauseMarkTime;
+    std::chrono::microseconds _pauseSweepTime;
+    unsigned int _numMarkedCells;
+    unsigned int _liveAfterCollect;
+    std::chrono::steady_clock::time_point _lastPause;
+
+    // Copying collection; next free cell in the last to-space slab
+    bool _compacting;
+    unsigned int _copyIndex;
+
+    // Memory from the OS
+    CellRegion* _regions;
+    unsigned int _numRegions;
+    unsigned int _retainedSlabs;
+    bool _hugePages;
+
+    // Quota
+    unsigned int _cellLimit;
+    unsigned int _peakAllocList;
+
+    // Constant pool of string literals
+    std::unordered_map<std::string, Cell*> _literals;
+
+    // Frames of captured values, by generation; and free ones, ready for reuse
+    Scope* _youngFrames;
+    Scope* _oldFrames;
+    std::vector<Scope*> _framePool;
+    unsigned int _numFrames;
+
+    // Frames of calls, the first _frameDepth in use
+    std::vector<Scope*> _frameStack;
+    unsigned int _frameDepth;
+
+private:
+    CellAllocator(const CellAllocator&);
+    CellAllocator& operator=(const CellAllocator&);
+};
+
+// Makes a heap current on this thread for the lifetime of the object, then puts back the one before it.
+class HeapScope
+{
+public:
+    HeapScope(CellAllocator* pHeap) : _pPrevious(CellAllocator::GetCurrent()) { CellAllocator::SetCurrent(pHeap); }
+    ~HeapScope() { CellAllocator::SetCurrent(_pPrevious); }
+
+private:
+    CellAllocator* _pPrevious;
+};
+
+// Keeps a cell held in a local variable alive across collections, for the lifetime of the root.
+// The variable can be changed after it is rooted.
+class CellRoot
+{
+public:
+    CellRoot(Cell*& cell) { CellAllocator::Instance().PushRoot(&cell); }
+    ~CellRoot() { CellAllocator::Instance().PopRoot(); }
+};
+
+// As CellRoot, for a scope held in a local variable.
+class ScopeRoot
+{
+public:
+    ScopeRoot(Scope*& scope) { CellAllocator::Instance().PushRoot(&scope); }
+    ~ScopeRoot() { CellAllocator::Instance().PopScopeRoot(); }
+};
+
+// Owns the frame of a lambda's call, and pops it off the heap's stack when the call is over.
+// A tail call replaces it; the frame before is finished with, since closures only copy from it.
+// It goes first, so that a frame is always popped from the top.
+class FrameGuard
+{
+public:
+    FrameGuard() : _pFrame(nullptr) {}
+    ~FrameGuard() { Release(); }
+
+    // A new frame, inside the scope the lambda captured
+    Scope* Call(Scope* pOuter)
+    {
+        Release();
+        _pFrame = CellAllocator::Instance().PushFrame(pOuter);
+        return _pFrame;
+    }
+
+    void Release()
+    {
+        if (_pFrame != nullptr)
+        {
+            CellAllocator::Instance().PopFrame();
+            _pFrame = nullptr;
+        }
+    }
+
+private:
+    Scope* _pFrame;
 };
 
 } // Scheme
-} // Jorvik
+} // Jorvik
\ No newline at end of file
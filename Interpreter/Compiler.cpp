@@ -0,0 +1,310 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#include "pch.h"
+#include "Compiler.h"
+#include "Cell.h"
+#include "Evaluator.h"
+#include "Scope.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+// In the same order as the operator instructions
+static const char* OperatorNames[Instruction::NumOperators] = { "+", "-", "*", "<", ">", "=", "<=", ">=" };
+
+Bytecode::Bytecode()
+    : CompiledCode(BytecodeBackend),
+    pParams(nullptr),
+    fixedParams(false),
+    numParams(0),
+    threaded(false)
+{
+}
+
+Compiler::Compiler(Evaluator* pScheme)
+    : _pScheme(pScheme),
+    _pCode(nullptr)
+{
+    // The bindings are held here rather than by a global cell, so their names are pinned to keep them
+    for (unsigned int index = 0; index < Instruction::NumOperators; index++)
+    {
+        const Sym* pName = Sym::Symbol(OperatorNames[index]);
+        pName->Pin();
+        _operators[index] = pScheme->GetGlobalScope()->FindBinding(pName);
+    }
+}
+
+// An expression at the top level.  Nothing here is a safe point, and nothing is allocated.
+Bytecode* Compiler::Compile(Cell* cell)
+{
+    std::unique_ptr<Bytecode> code(new Bytecode());
+    _pCode = code.get();
+    Compile_Cell(cell, true);
+    _pCode = nullptr;
+    return code.release();
+}
+
+// The body of a lambda, and how it binds its arguments
+Bytecode* Compiler::CompileLambda(Cell* pLambda)
+{
+    std::unique_ptr<Bytecode> code(new Bytecode());
+    _pCode = code.get();
+
+    _pCode->pParams = pLambda->Car();
+    if (_pCode->pParams->IsPair())
+    {
+        _pCode->fixedParams = true;
+        _pCode->numParams = _pCode->pParams->Length();
+    }
+    pLambda->GetLambdaBoxed(_pCode->boxed);
+
+    Compile_Cell(pLambda->Cdr()->Car(), true);
+    _pCode = nullptr;
+    return code.release();
+}
+
+unsigned int Compiler::Emit(Instruction::Opcode op, Cell* pCell, uint32_t index)
+{
+    Instruction instruction;
+    instruction.op = op;
+    instruction.pCell = pCell;
+    instruction.ppBinding = nullptr;
+    instruction.index = index;
+    _pCode->instructions.push_back(instruction);
+    return (unsigned int)_pCode->instructions.size() - 1;
+}
+
+unsigned int Compiler::Emit(Instruction::Opcode op, Cell* pCell, Cell** ppBinding)
+{
+    unsigned int index = Emit(op, pCell);
+    _pCode->instructions[index].ppBinding = ppBinding;
+    return index;
+}
+
+// Point a jump at the next instruction
+void Compiler::Patch(unsigned int jump)
+{
+    _pCode->instructions[jump].index = (uint32_t)_pCode->instructions.size();
+}
+
+// The same cases as the interpreter, in the same order.  An expression in tail position returns its value, 
+// or is a tail call.
+void Compiler::Compile_Cell(Cell* cell, bool tail)
+{
+    if (cell->GetType() & Cell::LocalType)
+    {
+        switch (cell->GetDepth())
+        {
+        case 0:
+            Emit(cell->IsBoxed() ? Instruction::LocalBoxOp : Instruction::LocalOp, cell, cell->GetIndex());
+            break;
+        case 1:
+            Emit(cell->IsBoxed() ? Instruction::CapturedBoxOp : Instruction::CapturedOp, cell, cell->GetIndex());
+            break;
+        default:
+            Emit(Instruction::InterpretOp, cell);
+            break;
+        }
+    }
+    else if (cell->GetType() & Cell::GlobalType)
+    {
+        Emit(Instruction::GlobalOp, cell, cell->GetBinding());
+    }
+    else if (cell->GetType() & Cell::SymbolType)
+    {
+        Emit(Instruction::VariableOp, cell);
+    }
+    else if (cell->IsAtom())
+    {
+        Emit(Instruction::ConstantOp, cell);
+    }
+    else if (cell->GetType() & Cell::PairType)
+    {
+        // Anything badly formed is left for the interpreter to complain about, when it is reached
+        if (cell->Length() == 0)
+        {
+            Emit(Instruction::InterpretOp, cell);
+        }
+        else if (cell->Car()->GetType() & Cell::SymbolType)
+        {
+            switch (cell->Car()->GetSymbol()->GetForm())
+            {
+            case Sym::QuoteForm:
+                Emit(Instruction::ConstantOp, cell->Cdr()->Car());
+                break;
+            case Sym::IfForm:
+                Compile_If(cell, tail);
+                return;
+            case Sym::SetForm:
+                Compile_Set(cell, false);
+                break;
+            case Sym::DefineForm:
+                Compile_Set(cell, true);
+                break;
+            case Sym::LambdaForm:
+                Compile_Lambda(cell);
+                break;
+            case Sym::BeginForm:
+                Compile_Begin(cell, tail);
+                return;
+            default:
+                Compile_Call(cell, tail);
+                return;
+            }
+        }
+        else
+        {
+            Compile_Call(cell, tail);
+            return;
+        }
+    }
+    else
+    {
+        Emit(Instruction::ConstantOp, cell);
+    }
+
+    if (tail)
+    {
+        Emit(Instruction::ReturnOp);
+    }
+}
+
+// (if test conseq alt); in tail position, both branches return
+void Compiler::Compile_If(Cell* cell, bool tail)
+{
+    Compile_Cell(cell->Cdr()->Car(), false);
+    unsigned int jumpAlt = Emit(Instruction::JumpIfFalseOp);
+    Compile_Cell(cell->Cdr()->Cdr()->Car(), tail);
+    if (tail)
+    {
+        Patch(jumpAlt);
+        Compile_Cell(cell->Cdr()->Cdr()->Cdr()->Car(), true);
+        return;
+    }
+
+    unsigned int jumpEnd = Emit(Instruction::JumpOp);
+    Patch(jumpAlt);
+    Compile_Cell(cell->Cdr()->Cdr()->Cdr()->Car(), false);
+    Patch(jumpEnd);
+}
+
+// (set! var value) or (define var value).  A local is always defined in the call's own frame.
+void Compiler::Compile_Set(Cell* cell, bool define)
+{
+    Cell* pSymbol = cell->Cdr()->Car();
+    if (!(pSymbol->GetType() & (Cell::LocalType | Cell::GlobalType | Cell::SymbolType)))
+    {
+        Emit(Instruction::InterpretOp, cell);
+        return;
+    }
+
+    Compile_Cell(cell->Cdr()->Cdr()->Car(), false);
+    if (pSymbol->GetType() & Cell::LocalType)
+    {
+        if (define)
+        {
+            Emit(pSymbol->IsBoxed() ? Instruction::DefineLocalBoxOp : Instruction::DefineLocalOp, pSymbol, pSymbol->GetIndex());
+        }
+        else
+        {
+            Emit(Instruction::SetLocalOp, pSymbol, pSymbol->GetIndex());
+        }
+    }
+    else if (pSymbol->GetType() & Cell::GlobalType)
+    {
+        Emit(define ? Instruction::DefineGlobalOp : Instruction::SetGlobalOp, pSymbol, pSymbol->GetBinding());
+    }
+    else
+    {
+        Emit(define ? Instruction::DefineVariableOp : Instruction::SetVariableOp, pSymbol);
+    }
+}
+
+// The closure copies what it captures from where the resolver found it
+void Compiler::Compile_Lambda(Cell* cell)
+{
+    std::vector<LocalAddress> captures;
+    cell->Car()->GetLambdaCaptures(captures);
+    _pCode->closures.push_back(captures);
+    Emit(Instruction::ClosureOp, cell, uint32_t(_pCode->closures.size() - 1));
+}
+
+// Every expression's value but the last is dropped
+void Compiler::Compile_Begin(Cell* cell, bool tail)
+{
+    if (cell->Length() < 2)
+    {
+        Emit(Instruction::InterpretOp, cell);
+        if (tail)
+        {
+            Emit(Instruction::ReturnOp);
+        }
+        return;
+    }
+
+    for (Cell* pList = cell->Cdr(); pList != nullptr && pList->Car() != nullptr; pList = pList->Cdr())
+    {
+        bool last = pList->Cdr() == nullptr || pList->Cdr()->Car() == nullptr;
+        Compile_Cell(pList->Car(), tail && last);
+        if (!last)
+        {
+            Emit(Instruction::PopOp);
+        }
+    }
+}
+
+// The procedure, then its arguments.  An operator applied to two arguments gets an instruction of its own.
+void Compiler::Compile_Call(Cell* cell, bool tail)
+{
+    Cell* pProc = cell->Car();
+    Cell* pArgs = cell->Cdr();
+    unsigned int numArgs = pArgs ? pArgs->Length() : 0;
+
+    if (numArgs == 2 && (pProc->GetType() & Cell::GlobalType))
+    {
+        for (unsigned int index = 0; index < Instruction::NumOperators; index++)
+        {
+            if (pProc->GetBinding() == _operators[index])
+            {
+                Compile_Cell(pArgs->Car(), false);
+                Compile_Cell(pArgs->Cdr()->Car(), false);
+                Emit(Instruction::Opcode(Instruction::FirstOperatorOp + index), pProc, pProc->GetBinding());
+                if (tail)
+                {
+                    Emit(Instruction::ReturnOp);
+                }
+                return;
+            }
+        }
+    }
+
+    Compile_Cell(pProc, false);
+    for (Cell* pArg = pArgs; pArg != nullptr && pArg->Car() != nullptr; pArg = pArg->Cdr())
+    {
+        Compile_Cell(pArg->Car(), false);
+    }
+    Emit(tail ? Instruction::TailCallOp : Instruction::CallOp, cell, numArgs);
+}
+
+}
+}
@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#pragma once
+#include "Cell.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+class Evaluator;
+
+// One instruction of bytecode.  Instructions work on the virtual machine's stack of values: they push what they
+// find, and pop what they use.  Before it is run, the virtual machine can thread the code, replacing each opcode
+// with the address of the code that carries it out, so that it goes straight from one instruction to the next.
+struct Instruction
+{
+    enum Opcode
+    {
+        ConstantOp,         // push the cell
+        LocalOp,            // push a slot of the call's frame
+        LocalBoxOp,         // ... which holds a box
+        CapturedOp,         // push a slot of the values the closure captured
+        CapturedBoxOp,      // ... which holds a box
+        GlobalOp,           // push the value of a binding in the global scope
+        VariableOp,         // push the value of an unresolved symbol, found by name
+        SetLocalOp,         // pop a value, and set a local variable to it; push void
+        SetGlobalOp,
+        SetVariableOp,
+        DefineLocalOp,      // pop a value, and define a variable with it; push void
+        DefineLocalBoxOp,
+        DefineGlobalOp,
+        DefineVariableOp,
+        ClosureOp,          // push a closure of the lambda form
+        PopOp,
+        JumpOp,
+        JumpIfFalseOp,      // pop the test, and jump if it is false
+        CallOp,             // call the procedure under the arguments, and push what it returns
+        TailCallOp,         // ... in place of the current call, which returns what it returns
+        ReturnOp,           // pop the result, and return it
+        InterpretOp,        // push the result of interpreting the cell; for anything the compiler doesn't handle
+
+        // The arithmetic and comparison operators, done here for two small integers, and otherwise called
+        AddOp,
+        SubtractOp,
+        MultiplyOp,
+        LessOp,
+        GreaterOp,
+        EqualOp,
+        LessEqualOp,
+        GreaterEqualOp,
+        NumOpcodes,
+
+        FirstOperatorOp = AddOp,
+        NumOperators = NumOpcodes - AddOp
+    };
+
+    union
+    {
+        uintptr_t op;
+        const void* pHandler;
+    };
+
+    // The cell the instruction is about: a constant, a variable, a lambda form, or a call
+    Cell* pCell;
+
+    union
+    {
+        // A global's binding
+        Cell** ppBinding;
+
+        // A slot, a number of arguments, the instruction to jump to, or a closure's captures
+        uint32_t index;
+    };
+};
+
+// Code for the virtual machine; the body of a lambda, or an expression to run at the top level.
+// The instructions are held in one block, so they are next to each other in memory.
+struct Bytecode : public CompiledCode
+{
+    Bytecode();
+
+    std::vector<Instruction> instructions;
+
+    // Where each closure made by the code finds the values it captures
+    std::vector<std::vector<LocalAddress>> closures;
+
+    // How a lambda binds its arguments.  A list of parameters is filled in straight from the stack; anything
+    // else goes through Scope::Bind.  Then the boxed slots get their boxes.
+    Cell* pParams;
+    bool fixedParams;
+    unsigned int numParams;
+    std::vector<unsigned int> boxed;
+
+    bool threaded;
+};
+
+// Compiles resolved code to bytecode for the virtual machine.  Each expression is walked just once, so running
+// the code never has to look at the cells again, other than the constants.
+// Lambdas are compiled separately, when they are first called.
+class Compiler
+{
+public:
+    Compiler(Evaluator* pScheme);
+
+    Bytecode* Compile(Cell* cell);
+    Bytecode* CompileLambda(Cell* pLambda);
+
+    // The bindings of the operators that have instructions of their own
+    Cell** GetOperator(unsigned int index) const { return _operators[index]; }
+
+private:
+    void Compile_Cell(Cell* cell, bool tail);
+    void Compile_If(Cell* cell, bool tail);
+    void Compile_Set(Cell* cell, bool define);
+    void Compile_Lambda(Cell* cell);
+    void Compile_Begin(Cell* cell, bool tail);
+    void Compile_Call(Cell* cell, bool tail);
+    unsigned int Emit(Instruction::Opcode op, Cell* pCell = nullptr, uint32_t index = 0);
+    unsigned int Emit(Instruction::Opcode op, Cell* pCell, Cell** ppBinding);
+    void Patch(unsigned int jump);
+
+    Evaluator* _pScheme;
+    Bytecode* _pCode;
+    Cell** _operators[Instruction::NumOperators];
+};
+
+}
+}
@@ -23,33 +23,119 @@
 #include "Evaluator.h"
 
 #include "Parser.h"
+#include "Resolver.h"
 #include "Interpreter.h"
+#include "VirtualMachine.h"
+#include "Analyzer.h"
 #include "Tokenizer.h"
 #include "SchemeInit.h"
 #include "Scope.h"
 #include "Cell.h"
+#include "CellAllocator.h"
+#include "HeapImage.h"
 
 namespace Jorvik
 {
 namespace Scheme
 {
 
-Sym::tTextToSymbol Sym::MapTextToSymbol;
-
 unsigned int Evaluator::DebugFlags = 0;//Evaluator::Debug;
 
 Evaluator::Evaluator()
-    : _globalScope(new Scope())
+    : _mode(InterpretMode),
+    _heap(new CellAllocator()),
+    _globalScope(new Scope())
+{
+    Init();
+    Evaluate(SchemeInit);
+}
+
+Evaluator::Evaluator(const std::string& imagePath)
+    : _mode(InterpretMode),
+    _heap(new CellAllocator()),
+    _globalScope(new Scope())
+{
+    Init();
+
+    std::ifstream file(imagePath, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Could not open heap image: " + imagePath);
+    }
+    HeapImage::Load(_globalScope.get(), file);
+}
+
+// A new evaluator is left current, so that cells made before the first Evaluate land in its heap
+void Evaluator::Init()
 {
-    Cell::StaticInit();
+    MakeCurrent();
+    _heap->AddGlobalScope(_globalScope.get());
+
+    // The immediate cells are shared by every evaluator, on every thread
+    static std::once_flag staticInit;
+    std::call_once(staticInit, Cell::StaticInit);
 
     AddSymbols();
     
     _parser.reset(new Parser(this));
+    _resolver.reset(new Resolver(this));
     _interpreter.reset(new Interpreter(this));
+    _machine.reset(new VirtualMachine(this, _interpreter.get()));
+    _analyzer.reset(new Analyzer(this, _interpreter.get()));
     _tokenizer.reset(new Tokenizer(this));
+}
 
-    Evaluate(SchemeInit);
+void Evaluator::SaveImage(const std::string& imagePath)
+{
+    std::ofstream file(imagePath, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Could not create heap image: " + imagePath);
+    }
+    HeapImage::Save(_globalScope.get(), file);
+}
+
+// Everything is torn down with our own heap current, since scopes forget themselves from it as they go
+Evaluator::~Evaluator()
+{
+    CellAllocator* pHeap = _heap.get();
+    {
+        HeapScope heap(pHeap);
+        _heap->RemoveGlobalScope(_globalScope.get());
+        _analyzer.reset();
+        _machine.reset();
+        _interpreter.reset();
+        _parser.reset();
+        _resolver.reset();
+        _tokenizer.reset();
+        _globalScope.reset();
+        _heap.reset();
+    }
+
+    if (CellAllocator::GetCurrent() == pHeap)
+    {
+        CellAllocator::SetCurrent(nullptr);
+    }
+}
+
+void Evaluator::MakeCurrent()
+{
+    CellAllocator::SetCurrent(_heap.get());
+}
+
+void Evaluator::SetCellLimit(unsigned int cells)
+{
+    _heap->SetCellLimit(cells);
+}
+
+unsigned int Evaluator::GetCellLimit() const
+{
+    return _heap->GetCellLimit();
+}
+
+unsigned int Evaluator::GetPeakCells() const
+{
+    return _heap->GetPeakPoolSize();
 }
 
 void Evaluator::AddSymbols()
@@ -60,24 +146,40 @@ void Evaluator::AddSymbols()
 }
 
 
+// The expression is kept alive while we work on it, so callers can hang on to it.
 Cell* Evaluator::Parse(Cell* cell)
 {
-    return _parser->Parse(cell);
+    HeapScope heap(_heap.get());
+    CellRoot root(cell);
+    return _resolver->Resolve(_parser->Parse(cell));
 }
 
 Cell* Evaluator::Tokenize(const std::string& input)
 {
+    HeapScope heap(_heap.get());
     return _tokenizer->Tokenize(input);
 }
 
 Cell* Evaluator::Interpret(Cell* cell)
 {
-    return _interpreter->Interpret(cell, _globalScope);
+    HeapScope heap(_heap.get());
+    CellRoot root(cell);
+    if (_mode == VirtualMachineMode)
+    {
+        return _machine->Run(cell, _globalScope.get());
+    }
+    else if (_mode == AnalyzeMode)
+    {
+        return _analyzer->Run(cell, _globalScope.get());
+    }
+    return _interpreter->Interpret(cell, _globalScope.get());
 }
 
 Cell* Evaluator::Evaluate(const std::string& input)
 {
-    return Interpret(_parser->Parse(_tokenizer->Tokenize(input)));
+    HeapScope heap(_heap.get());
+    _heap->ResetPeakPoolSize();
+    return Interpret(_resolver->Resolve(_parser->Parse(_tokenizer->Tokenize(input))));
 }
 
 
@@ -27,9 +27,13 @@ namespace Scheme
 
 class Tokenizer;
 class Parser;
+class Resolver;
 class Interpreter;
+class VirtualMachine;
+class Analyzer;
 class Cell;
 class Scope;
+class CellAllocator;
 
 // A custom error returned when the expression is not complete
 class incomplete_expression_error : public std::runtime_error
@@ -49,15 +53,46 @@ public:
         Debug = 1
     };
 
+    // How code is run: by the interpreter walking the cells, compiled to bytecode for the virtual machine,
+    // or analysed into a tree of nodes
+    enum Mode
+    {
+        InterpretMode,
+        VirtualMachineMode,
+        AnalyzeMode
+    };
+
     Evaluator();
+    ~Evaluator();
+
+    // Start from a heap image made by SaveImage, instead of evaluating the prelude
+    explicit Evaluator(const std::string& imagePath);
+    void SaveImage(const std::string& imagePath);
 
     Cell* Evaluate(const std::string& input);
 
     Cell* Tokenize(const std::string& input);
+    // Parses, then resolves the local variables to lexical addresses, ready to interpret
     Cell* Parse(Cell* cell);
     Cell* Interpret(Cell* cell);
+
+    void SetMode(Mode mode) { _mode = mode; }
+    Mode GetMode() const { return _mode; }
     
     Scope* GetGlobalScope() { return _globalScope.get(); }
+
+    // Each evaluator has a heap of its own, which is current while it runs.
+    // MakeCurrent is for allocating cells in it from outside Evaluate.
+    CellAllocator& GetHeap() { return *_heap; }
+    void MakeCurrent();
+
+    // Most cells the heap may hold, 0 for no limit; see CellAllocator::SetCellLimit.
+    // An Evaluate that needs more throws heap_limit_error.
+    void SetCellLimit(unsigned int cells);
+    unsigned int GetCellLimit() const;
+
+    // Most cells in use at once during the last Evaluate
+    unsigned int GetPeakCells() const;
     
     static const bool TestDebugFlag(DebugFlag flag) { return DebugFlags & flag ? true : false; }
     static void SetDebugFlag(DebugFlag flag) { DebugFlags |= (unsigned int)flag; }
@@ -66,16 +101,23 @@ public:
 
 private:
     // Setup
+    void Init();
     void AddSymbols();
     void AddIntrinsics();
 
 private:
     static unsigned int DebugFlags; 
 
-    std::shared_ptr<Scope> _globalScope;
+    Mode _mode;
+
+    std::unique_ptr<CellAllocator> _heap;
+    std::unique_ptr<Scope> _globalScope;
     std::unique_ptr<Parser> _parser;
+    std::unique_ptr<Resolver> _resolver;
     std::unique_ptr<Tokenizer> _tokenizer;
     std::unique_ptr<Interpreter> _interpreter;
+    std::unique_ptr<VirtualMachine> _machine;
+    std::unique_ptr<Analyzer> _analyzer;
 };
 
 } // Scheme
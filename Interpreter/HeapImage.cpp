@@ -0,0 +1,427 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+#include "pch.h"
+
+#include <cstring>
+
+#include "HeapImage.h"
+#include "Cell.h"
+#include "CellAllocator.h"
+#include "Scope.h"
+#include "Symbol.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+static const char ImageMagic[4] = { 'J', 'V', 'K', 'I' };
+static const uint32_t ImageVersion = 6;
+
+// A reference to a cell: its number in the image, or an immediate, or null
+static const uint32_t NullRef = 0xFFFFFFFF;
+static const uint32_t ImmediateRef = 0x80000000;
+
+struct ImageHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t cellSize;
+    uint32_t numSymbols;
+    uint32_t numStrings;
+    uint32_t numCells;
+    uint32_t numScopes;
+    uint32_t scopeWords;
+};
+
+// A cell as written to the image.  The value is the cdr of a pair, the number of a symbol, string or scope,
+// or the bits of an integer or float.
+struct ImageCell
+{
+    uint32_t kind;
+    uint32_t car;
+    uint64_t value;
+};
+
+static void WriteString(std::ostream& stream, const std::string& str)
+{
+    uint32_t length = (uint32_t)str.size();
+    stream.write((const char*)&length, sizeof(length));
+    stream.write(str.data(), length);
+}
+
+static std::string ReadString(std::istream& stream)
+{
+    uint32_t length = 0;
+    stream.read((char*)&length, sizeof(length));
+    std::string str(stream ? length : 0, '\0');
+    stream.read(&str[0], str.size());
+    return str;
+}
+
+// Number everything reachable from the global scope, in the order it is found; then write out the tables.
+// Scopes are written as the number of their outer scope and of their variables, followed by the variables,
+// then the number of their slots and the slots.
+void HeapImage::Save(Scope* pGlobal, std::ostream& stream)
+{
+    std::vector<Cell*> cells;
+    std::vector<Scope*> scopes;
+    std::vector<const Sym*> symbols;
+    std::vector<const std::string*> strings;
+    std::unordered_map<const void*, uint32_t> numbers;
+
+    auto cellRef = [&](Cell* pCell) -> uint32_t
+    {
+        if (pCell == nullptr)
+        {
+            return NullRef;
+        }
+        if (Cell::IsImmediate(pCell))
+        {
+            return ImmediateRef | uint32_t(pCell - Cell::ImmediateCells);
+        }
+        auto itr = numbers.find(pCell);
+        if (itr != numbers.end())
+        {
+            return itr->second;
+        }
+        numbers[pCell] = (uint32_t)cells.size();
+        cells.push_back(pCell);
+        return (uint32_t)cells.size() - 1;
+    };
+
+    auto scopeRef = [&](Scope* pScope) -> uint32_t
+    {
+        auto itr = numbers.find(pScope);
+        if (itr != numbers.end())
+        {
+            return itr->second;
+        }
+        numbers[pScope] = (uint32_t)scopes.size();
+        scopes.push_back(pScope);
+        return (uint32_t)scopes.size() - 1;
+    };
+
+    auto symbolRef = [&](const Sym* pSymbol) -> uint32_t
+    {
+        auto itr = numbers.find(pSymbol);
+        if (itr != numbers.end())
+        {
+            return itr->second;
+        }
+        numbers[pSymbol] = (uint32_t)symbols.size();
+        symbols.push_back(pSymbol);
+        return (uint32_t)symbols.size() - 1;
+    };
+
+    std::vector<ImageCell> cellRecords;
+    std::vector<uint32_t> scopeRecords;
+
+    // The global scope is always the first
+    scopeRef(pGlobal);
+
+    // Cells and scopes refer to each other, so keep going until neither finds anything new
+    size_t nextCell = 0;
+    size_t nextScope = 0;
+    while (nextCell < cells.size() || nextScope < scopes.size())
+    {
+        while (nextScope < scopes.size())
+        {
+            Scope* pScope = scopes[nextScope++];
+            scopeRecords.push_back(pScope->_pOuter ? scopeRef(pScope->_pOuter) : NullRef);
+            size_t countWord = scopeRecords.size();
+            scopeRecords.push_back(0);
+            for (auto& var : pScope->_variables)
+            {
+                // Unbound globals are made again by the code that refers to them
+                if (var.second != nullptr)
+                {
+                    scopeRecords.push_back(symbolRef(var.first));
+                    scopeRecords.push_back(cellRef(var.second));
+                    scopeRecords[countWord]++;
+                }
+            }
+            scopeRecords.push_back((uint32_t)pScope->_slots.size());
+            for (auto pSlot : pScope->_slots)
+            {
+                scopeRecords.push_back(cellRef(pSlot));
+            }
+        }
+
+        while (nextCell < cells.size())
+        {
+            Cell* pCell = cells[nextCell++];
+
+            ImageCell record;
+            record.kind = pCell->GetKind();
+            record.car = cellRef(pCell->GetCar());
+            record.value = 0;
+
+            switch (pCell->GetKind())
+            {
+            case Cell::PairKind:
+                record.value = cellRef(pCell->_cdr);
+                break;
+            case Cell::SymbolKind:
+                record.value = symbolRef(pCell->_pSymbol);
+                break;
+            case Cell::StringKind:
+                record.value = strings.size();
+                strings.push_back(pCell->_pString);
+                break;
+            case Cell::IntegerKind:
+                record.value = uint64_t(pCell->_integer);
+                break;
+            case Cell::FloatKind:
+                memcpy(&record.value, &pCell->_float, sizeof(pCell->_float));
+                break;
+            case Cell::ProcedureKind:
+                if (pCell->GetCar() == nullptr)
+                {
+                    throw std::runtime_error("Can't save a procedure without a name to a heap image");
+                }
+                break;
+            case Cell::LambdaKind:
+                record.value = pCell->_pScope ? scopeRef(pCell->_pScope) : NullRef;
+                break;
+            case Cell::LocalKind:
+                record.value = (uint64_t(pCell->_local.boxed) << 48) | (uint64_t(pCell->_local.depth) << 32) | pCell->_local.index;
+                break;
+            case Cell::GlobalKind:
+                break;
+            case Cell::CodeKind:
+                // Compiled code isn't saved; a lambda is compiled again when it is next called
+                break;
+            default:
+                throw std::runtime_error("Can't save a freed cell to a heap image");
+            }
+            cellRecords.push_back(record);
+        }
+    }
+
+    ImageHeader header;
+    memcpy(header.magic, ImageMagic, sizeof(ImageMagic));
+    header.version = ImageVersion;
+    header.cellSize = sizeof(Cell);
+    header.numSymbols = (uint32_t)symbols.size();
+    header.numStrings = (uint32_t)strings.size();
+    header.numCells = (uint32_t)cellRecords.size();
+    header.numScopes = (uint32_t)scopes.size();
+    header.scopeWords = (uint32_t)scopeRecords.size();
+    stream.write((const char*)&header, sizeof(header));
+
+    for (auto pSymbol : symbols)
+    {
+        WriteString(stream, *pSymbol);
+    }
+    for (auto pString : strings)
+    {
+        WriteString(stream, *pString);
+    }
+    stream.write((const char*)cellRecords.data(), cellRecords.size() * sizeof(ImageCell));
+    stream.write((const char*)scopeRecords.data(), scopeRecords.size() * sizeof(uint32_t));
+
+    if (!stream)
+    {
+        throw std::runtime_error("Failed to write heap image");
+    }
+}
+
+// Read the tables, make a cell for every record, and then relocate the references between them.
+// Nothing here is a safe point, so the new cells don't need rooting until they are bound in the global scope.
+void HeapImage::Load(Scope* pGlobal, std::istream& stream)
+{
+    ImageHeader header;
+    stream.read((char*)&header, sizeof(header));
+    if (!stream ||
+        memcmp(header.magic, ImageMagic, sizeof(ImageMagic)) != 0 ||
+        header.version != ImageVersion ||
+        header.cellSize != sizeof(Cell) ||
+        header.numScopes == 0)
+    {
+        throw std::runtime_error("Not a heap image, or one from a different build");
+    }
+
+    std::vector<const Sym*> symbols;
+    for (uint32_t index = 0; index < header.numSymbols; index++)
+    {
+        symbols.push_back(Sym::Symbol(ReadString(stream)));
+    }
+
+    std::vector<std::string> strings;
+    for (uint32_t index = 0; index < header.numStrings; index++)
+    {
+        strings.push_back(ReadString(stream));
+    }
+
+    std::vector<ImageCell> cellRecords(header.numCells);
+    stream.read((char*)cellRecords.data(), cellRecords.size() * sizeof(ImageCell));
+    std::vector<uint32_t> scopeRecords(header.scopeWords);
+    stream.read((char*)scopeRecords.data(), scopeRecords.size() * sizeof(uint32_t));
+    if (!stream)
+    {
+        throw std::runtime_error("Heap image is truncated");
+    }
+
+    // The first scope is the global one, which we already have.  The rest hold the values closures captured.
+    std::vector<Scope*> scopes(header.numScopes);
+    scopes[0] = pGlobal;
+    for (uint32_t index = 1; index < header.numScopes; index++)
+    {
+        scopes[index] = CellAllocator::Instance().AllocFrame();
+    }
+
+    // Procedures are the intrinsics of the same name
+    std::vector<Cell*> cells(header.numCells);
+    for (uint32_t index = 0; index < header.numCells; index++)
+    {
+        const ImageCell& record = cellRecords[index];
+        switch (record.kind)
+        {
+        case Cell::PairKind:
+            cells[index] = Cell::Pair();
+            break;
+        case Cell::SymbolKind:
+            cells[index] = Cell::Symbol(symbols.at(size_t(record.value)));
+            break;
+        case Cell::StringKind:
+            cells[index] = Cell::String(strings.at(size_t(record.value)).c_str());
+            break;
+        case Cell::IntegerKind:
+            cells[index] = Cell::Integer(tCellInteger(record.value));
+            break;
+        case Cell::FloatKind:
+        {
+            tCellFloat value;
+            memcpy(&value, &record.value, sizeof(value));
+            cells[index] = Cell::Float(value);
+        }
+        break;
+        case Cell::ProcedureKind:
+        {
+            const ImageCell& name = cellRecords.at(record.car);
+            const Sym* pName = name.kind == Cell::SymbolKind ? symbols.at(size_t(name.value)) : nullptr;
+            Cell* pProcedure = pName ? pGlobal->FindVariable(pName) : nullptr;
+            if (pProcedure == nullptr || !(pProcedure->GetType() & Cell::ProcedureType))
+            {
+                throw std::runtime_error("Heap image uses an intrinsic that doesn't exist");
+            }
+            cells[index] = pProcedure;
+        }
+        break;
+        case Cell::LambdaKind:
+        {
+            Cell& cell = CellAllocator::Instance().Alloc();
+            cell.Set(Cell::LambdaKind, nullptr);
+            cell._pScope = record.value != NullRef ? scopes.at(size_t(record.value)) : nullptr;
+            cells[index] = &cell;
+        }
+        break;
+        case Cell::LocalKind:
+            cells[index] = Cell::Local(nullptr, uint32_t(record.value >> 32) & 0xFFFF, uint32_t(record.value), (record.value >> 48) != 0);
+            break;
+        case Cell::GlobalKind:
+        {
+            // Bound to the same name in the new global scope; void is a name too
+            const Sym* pName = nullptr;
+            if (record.car == (ImmediateRef | Cell::VoidImmediate))
+            {
+                pName = Cell::Void()->GetSymbol();
+            }
+            else if (!(record.car & ImmediateRef) && cellRecords.at(record.car).kind == Cell::SymbolKind)
+            {
+                pName = symbols.at(size_t(cellRecords.at(record.car).value));
+            }
+            if (pName == nullptr)
+            {
+                throw std::runtime_error("Heap image has a global without a name");
+            }
+            cells[index] = Cell::Global(nullptr, pGlobal->FindBinding(pName));
+        }
+        break;
+        case Cell::CodeKind:
+            cells[index] = nullptr;
+            break;
+        default:
+            throw std::runtime_error("Heap image has a bad cell");
+        }
+    }
+
+    auto resolve = [&](uint64_t ref) -> Cell*
+    {
+        if (ref == NullRef)
+        {
+            return nullptr;
+        }
+        if (ref & ImmediateRef)
+        {
+            if ((ref & ~ImmediateRef) >= Cell::NumImmediates)
+            {
+                throw std::runtime_error("Heap image has a bad immediate");
+            }
+            return &Cell::ImmediateCells[ref & ~ImmediateRef];
+        }
+        return cells.at(size_t(ref));
+    };
+
+    for (uint32_t index = 0; index < header.numCells; index++)
+    {
+        const ImageCell& record = cellRecords[index];
+        if (record.kind == Cell::PairKind)
+        {
+            cells[index]->SetCar(resolve(record.car));
+            cells[index]->_cdr = resolve(record.value);
+        }
+        else if (record.kind == Cell::LambdaKind || record.kind == Cell::LocalKind || record.kind == Cell::GlobalKind ||
+            record.kind == Cell::SymbolKind)
+        {
+            // A symbol's car is what the resolver found out about a lambda
+            cells[index]->SetCar(resolve(record.car));
+        }
+    }
+
+    // Fill in the scopes.  The global variables go in last, over the top of the intrinsics.
+    size_t word = 0;
+    for (uint32_t index = 0; index < header.numScopes; index++)
+    {
+        uint32_t outer = scopeRecords.at(word++);
+        uint32_t numVariables = scopeRecords.at(word++);
+        if (index != 0 && outer != NullRef)
+        {
+            scopes[index]->_pOuter = scopes.at(outer);
+        }
+
+        for (uint32_t variable = 0; variable < numVariables; variable++)
+        {
+            const Sym* pSymbol = symbols.at(scopeRecords.at(word++));
+            Cell* pCell = resolve(scopeRecords.at(word++));
+            scopes[index]->AddVariable(pSymbol, pCell);
+        }
+
+        uint32_t numSlots = scopeRecords.at(word++);
+        for (uint32_t slot = 0; slot < numSlots; slot++)
+        {
+            scopes[index]->SetSlot(slot, resolve(scopeRecords.at(word++)));
+        }
+    }
+}
+
+} // Scheme
+} // Jorvik
@@ -0,0 +1,45 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+#pragma once
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+class Cell;
+class Scope;
+
+// A heap image is everything reachable from a global scope, written out so that an evaluator can start from it
+// instead of evaluating its prelude again.
+// Cells are numbered, and written as fixed size records which refer to each other by number; loading allocates
+// a fresh cell for each record, and relocates the numbers into pointers.  Symbols and strings go in tables of
+// their own, since they live outside the heap.
+// Intrinsics are C++ code, so can't be saved; a procedure is written as its name, and bound to the intrinsic of
+// the same name in the evaluator being loaded into.
+class HeapImage
+{
+public:
+    static void Save(Scope* pGlobal, std::ostream& stream);
+    static void Load(Scope* pGlobal, std::istream& stream);
+};
+
+} // Scheme
+} // Jorvik
@@ -26,6 +26,7 @@
 #include "Intrinsics.h"
 #include "Interpreter.h"
 #include "Errors.h"
+#include "CellAllocator.h"
 
 namespace Jorvik
 {
@@ -40,9 +41,10 @@ Interpreter::Interpreter(Evaluator* pScheme)
 }
 
 // Build a Cell containing the list entries, Interpreting them as we go
-Cell* Interpreter::InterpretList(Cell* pList, std::shared_ptr<Scope>& pScope)
+Cell* Interpreter::InterpretList(Cell* pList, Scope* pScope)
 {
     Cell* pRet = Cell::EmptyList();
+    CellRoot retRoot(pRet);
     while(pList && pList->Car())
     {
         pRet = pRet->Append(Interpret(pList->Car(), pScope));
@@ -52,12 +54,39 @@ Cell* Interpreter::InterpretList(Cell* pList, std::shared_ptr<Scope>& pScope)
 }
 
 // The main intepreter.  Loops over the cells evaluating as it goes.
-Cell* Interpreter::Interpret(Cell* cell, std::shared_ptr<Scope> pScope)
+Cell* Interpreter::Interpret(Cell* cell, Scope* pScope)
 {   
+    // Everything held here must survive a collection in a nested call
+    Cell* proc = nullptr;
+    CellRoot cellRoot(cell);
+    CellRoot procRoot(proc);
+    ScopeRoot scopeRoot(pScope);
+    FrameGuard frame;
+
     // Try to loop to reduce stack depth
     for(;;)
     {
-        if (cell->GetType() & Cell::SymbolType)
+        CellAllocator::Instance().SafePoint();
+
+        if (cell->GetType() & Cell::LocalType)
+        {
+            // A resolved variable; straight to its slot
+            Cell* found = pScope->GetFrame(cell->GetDepth())->GetSlot(cell->GetIndex());
+            if (found != nullptr && cell->IsBoxed())
+            {
+                found = found->Unbox();
+            }
+            THROW_ERROR_IF(found == nullptr, cell, "Variable not found: " << (const std::string)*cell->GetVariableSymbol());
+            return found;
+        }
+        else if (cell->GetType() & Cell::GlobalType)
+        {
+            // Resolved to its binding
+            Cell* found = *cell->GetBinding();
+            THROW_ERROR_IF(found == nullptr, cell, "Variable not found: " << (const std::string)*cell->GetVariableSymbol());
+            return found;
+        }
+        else if (cell->GetType() & Cell::SymbolType)
         {
             // Found a symbol, return it.
             Cell* found = pScope->FindVariable(cell->GetSymbol());
@@ -77,15 +106,15 @@ Cell* Interpreter::Interpret(Cell* cell, std::shared_ptr<Scope> pScope)
             {
                 // Note that Parse will already have done some work for us to reduce expressions to 
                 // symbols where appropriate
-                const Sym* sym = cell->Car()->GetSymbol();
-            
+                switch (cell->Car()->GetSymbol()->GetForm())
+                {
                 // Return the quoted expression
-                if (sym == Sym::Symbol("_quote"))
+                case Sym::QuoteForm:
                 {
                     return cell->Cdr()->Car();
                 }
                 // Handle the if/then/else branch
-                else if (sym == Sym::Symbol("_if"))
+                case Sym::IfForm:
                 {
                     Cell* testResult = Interpret(cell->Cdr()->Car(), pScope);
 
@@ -104,33 +133,71 @@ Cell* Interpreter::Interpret(Cell* cell, std::shared_ptr<Scope> pScope)
                     continue;
                 }
                 // Set a variable.
-                else if (sym == Sym::Symbol("_set!"))
+                case Sym::SetForm:
                 {
                     Cell* pSet = Interpret(cell->Cdr()->Cdr()->Car(), pScope); 
                     Cell* pSymbol = cell->Cdr()->Car();
+                    if (pSymbol->GetType() & Cell::LocalType)
+                    {
+                        Scope* pFrame = pScope->GetFrame(pSymbol->GetDepth());
+                        Cell* pSlot = pFrame->GetSlot(pSymbol->GetIndex());
+                        THROW_ERROR_IF(pSlot == nullptr || (pSymbol->IsBoxed() && pSlot->Unbox() == nullptr), pSet, "Could not set variable: " << (std::string)*pSymbol->GetVariableSymbol());
+                        if (pSymbol->IsBoxed())
+                        {
+                            pSlot->SetBox(pSet);
+                        }
+                        else
+                        {
+                            pFrame->SetSlot(pSymbol->GetIndex(), pSet);
+                        }
+                        return Cell::Void();
+                    }
+                    else if (pSymbol->GetType() & Cell::GlobalType)
+                    {
+                        THROW_ERROR_IF(*pSymbol->GetBinding() == nullptr, pSet, "Could not set variable: " << (std::string)*pSymbol->GetVariableSymbol());
+                        _pScheme->GetGlobalScope()->SetBinding(pSymbol->GetBinding(), pSet);
+                        return Cell::Void();
+                    }
                     THROW_ERROR_IF(!(pSymbol->GetType() & Cell::SymbolType), pSymbol, "Not a symbol in set: " << pSymbol);
                     THROW_ERROR_IF(!pScope->SetVariable(pSymbol->GetSymbol(), pSet), pSet, "Could not set variable: " << (std::string)*pSymbol->GetSymbol());
                     return Cell::Void();
                 }
                 // Define a variable
-                else if (sym == Sym::Symbol("_define"))
+                case Sym::DefineForm:
                 {
                     Cell* pDefine = Interpret(cell->Cdr()->Cdr()->Car(), pScope); 
                     Cell* pSymbol = cell->Cdr()->Car();
+                    if (pSymbol->GetType() & Cell::LocalType)
+                    {
+                        if (pSymbol->IsBoxed())
+                        {
+                            pScope->GetSlot(pSymbol->GetIndex())->SetBox(pDefine);
+                        }
+                        else
+                        {
+                            pScope->SetSlot(pSymbol->GetIndex(), pDefine);
+                        }
+                        return Cell::Void();
+                    }
+                    else if (pSymbol->GetType() & Cell::GlobalType)
+                    {
+                        _pScheme->GetGlobalScope()->SetBinding(pSymbol->GetBinding(), pDefine);
+                        return Cell::Void();
+                    }
                     THROW_ERROR_IF(!(pSymbol->GetType() & Cell::SymbolType), pSymbol, "Not a symbol in set: " << pSymbol);
                     pScope->AddVariable(pSymbol->GetSymbol(), pDefine);
                     return Cell::Void();
                 }
                 // Creates a lambda function from args and body
-                else if (sym == Sym::Symbol("_lambda"))
+                case Sym::LambdaForm:
                 {
                     // We already parsed and created the lambda,
                     // turn it into a function we can call.
-                    // lambda pArgs, pBody , scope
-                    return Cell::Lambda(cell->Cdr()->Car(), cell->Cdr()->Cdr()->Car(), pScope);
+                    cell->Car()->GetLambdaCaptures(_captures);
+                    return Cell::Lambda(cell, pScope->Capture(_captures));
                 }
                 // Generate a list of expressions to evaluate in the begin
-                else if (sym == Sym::Symbol("_begin"))
+                case Sym::BeginForm:
                 {
                     THROW_ERROR_IF(cell->Length() < 2, cell,  "Not enough args in begin: " << cell);
              
@@ -144,10 +211,13 @@ Cell* Interpreter::Interpret(Cell* cell, std::shared_ptr<Scope> pScope)
                     }
                     return pLastResult->Car(); 
                 }
+                default:
+                    break;
+                }
             }
         
             // Procedure and args, all evaluated.
-            Cell* proc = Interpret(cell->Car(), pScope);
+            proc = Interpret(cell->Car(), pScope);
             Cell* args = InterpretList(cell->Cdr(), pScope);
     
             // If a lambda, loop around and evaluate the body at the new scope.
@@ -156,15 +226,18 @@ Cell* Interpreter::Interpret(Cell* cell, std::shared_ptr<Scope> pScope)
                 Cell* params = proc->Car();
                 Cell* body = proc->Cdr()->Car();
 
-                // Alloc a scope, because we we are going to make the lambda right now.
-                pScope = std::shared_ptr<Scope>(new Scope(params, args, proc->GetScope()));
+                // Alloc a frame, because we we are going to make the lambda right now.
+                pScope = frame.Call(proc->GetScope());
+                pScope->Bind(params, args);
+                proc->GetLambdaBoxed(_boxed);
+                pScope->BoxSlots(_boxed);
                 cell = body;
 
                 if (Evaluator::TestDebugFlag(Evaluator::Debug))
                 {
-                    if (pScope.get() != _pScheme->GetGlobalScope())
+                    if (pScope != _pScheme->GetGlobalScope())
                     {
-                        std::cout << "Lambda Scope: " << std::endl << pScope;
+                        std::cout << "Lambda Scope: " << std::endl << *pScope;
                         std::cout << "Lambda P: " << params << " A: " << args << " B: " << body << std::endl << std::endl;
                     }
                 }
@@ -19,6 +19,7 @@
 // 3. This notice may not be removed or altered from any source distribution.
 //
 #pragma once
+#include "Cell.h"
 
 namespace Jorvik
 {
@@ -31,11 +32,15 @@ class Interpreter
 public:
     Interpreter(Evaluator* pScheme);
 
-    Cell* Interpret(Cell* cell, std::shared_ptr<Scope> pScope);
-    Cell* InterpretList(Cell* args, std::shared_ptr<Scope>& pScope);
+    Cell* Interpret(Cell* cell, Scope* pScope);
+    Cell* InterpretList(Cell* args, Scope* pScope);
 
 private:
     Evaluator* _pScheme;
+
+    // Lambda info, decoded just long enough to use it
+    std::vector<LocalAddress> _captures;
+    std::vector<unsigned int> _boxed;
 };
 
 
@@ -26,6 +26,7 @@
 #include "Errors.h"
 #include "Evaluator.h"
 #include "Symbol.h"
+#include "CellAllocator.h"
 
 namespace Jorvik
 {
@@ -34,8 +35,9 @@ namespace Scheme
 
 // We declare c++ function lambdas and add them to cells in the global scope.
 // They are looked up by symbol name.  This macro just hides the crud below.
-#define BEGIN_FUNC(sym) pScope->AddVariable(Sym::Symbol(#sym), Cell::Procedure([=](Cell* args) {
-#define END_FUNC }))
+// Each procedure carries its name, so a heap image can find it again.
+#define BEGIN_FUNC(sym) { const char* pszFuncName = #sym; pScope->AddVariable(Sym::Symbol(pszFuncName), Cell::Procedure([=](Cell* args) {
+#define END_FUNC }, pszFuncName)); }
 
 void Intrinsics::Add(Scope* pScope)
 {
@@ -259,6 +261,38 @@ void Intrinsics::AddInternalOperands(Scope* pScope)
         std::cout << str.str();
         return Cell::Void();
     END_FUNC;
+
+    // What the collector has been doing, as an association list
+    BEGIN_FUNC(gc-stats)
+        UNUSED(args);
+        const GCStats& stats = CellAllocator::Instance().GetStats();
+
+        Cell* pStats = Cell::EmptyList();
+        auto add = [&](const char* pszName, uint64_t value)
+        {
+            pStats = pStats->Append(Cell::Pair(Cell::Symbol(Sym::Symbol(pszName)), Cell::Integer(tCellInteger(value))));
+        };
+        add("pauses", stats.pauses);
+        add("mark-time", stats.markTime);
+        add("sweep-time", stats.sweepTime);
+        add("pause-time", stats.pauseTime);
+        add("interval", stats.interval);
+        add("cells-marked", stats.cellsMarked);
+        add("cells-freed", stats.cellsFreed);
+        add("bytes-allocated", stats.bytesAllocated);
+        add("max-pause-time", stats.maxPauseTime);
+        add("total-pause-time", stats.totalPauseTime);
+        add("total-cells-marked", stats.totalCellsMarked);
+        add("total-cells-freed", stats.totalCellsFreed);
+        add("total-bytes-allocated", stats.totalBytesAllocated);
+
+        Cell* pHistogram = Cell::Pair(Cell::Symbol(Sym::Symbol("pause-histogram")));
+        for (auto count : stats.pauseHistogram)
+        {
+            pHistogram->Append(Cell::Integer(count));
+        }
+        return pStats->Append(pHistogram);
+    END_FUNC;
 }
 }
 }
@@ -23,6 +23,7 @@
 #include "Parser.h"
 #include "Cell.h"
 #include "Errors.h"
+#include "CellAllocator.h"
 
 namespace Jorvik
 {
@@ -81,6 +82,7 @@ Cell* Parser::Parse_Set(Cell* pSet)
                 
     // Parse the third entry
     Cell* pRet = Cell::Pair(pSet->Car());
+    CellRoot retRoot(pRet);
     pRet = pRet->Append(pSet->Cdr()->Car());
 
     return pRet->Append(Parse_Cell(pSet->Cdr()->Cdr()->Car()));
@@ -107,10 +109,10 @@ Cell* Parser::Parse_Define(Cell* cell, bool topLevel)
         Cell* args = pParams->Cdr();
 
         // (define)
-        Cell* pDefine = Cell::Pair(Cell::Symbol(Sym::Symbol("_define")), nullptr);
+        Cell* pDefine = Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::DefineForm)), nullptr);
         
         // (lambda)
-        Cell* pLambda = Cell::Pair(Cell::Symbol(Sym::Symbol("_lambda")), nullptr);
+        Cell* pLambda = Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::LambdaForm)), nullptr);
         
         // (lambda (args)
         pLambda = pLambda->Append(args);
@@ -140,7 +142,7 @@ Cell* Parser::Parse_Define(Cell* cell, bool topLevel)
         pBody = Parse_Cell(pBody->Car());
 
         // (define)
-        Cell* pDefine = Cell::Pair(Cell::Symbol(Sym::Symbol("_define")), nullptr);
+        Cell* pDefine = Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::DefineForm)), nullptr);
 
         // (define (params)
         pDefine = pDefine->Append(pParams);
@@ -160,7 +162,8 @@ Cell* Parser::Parse_Begin(Cell* cell, bool topLevel)
     {
         return Cell::Void();
     }
-    Cell* pBegin = Cell::Pair(Cell::Symbol(Sym::Symbol("_begin")));
+    Cell* pBegin = Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::BeginForm)));
+    CellRoot beginRoot(pBegin);
 
     Cell* pCurrent = cell->Cdr();
     while (pCurrent && pCurrent->Car())
@@ -175,7 +178,7 @@ Cell* Parser::Parse_Begin(Cell* cell, bool topLevel)
 // Was initially part of the parser, now will be done as a macro
 Cell* Parser::Parse_Quasiquote(Cell* pQuasi)
 {
-    Cell* pQuote = Cell::Pair(Cell::Symbol(Sym::Symbol("_quote")), pQuasi);
+    Cell* pQuote = Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::QuoteForm)), pQuasi);
     return pQuote;
 }
 
@@ -200,7 +203,8 @@ Cell* Parser::Parse_Lambda(Cell* cell)
     }
 
     // (_lambda (args) ... (body) / (begin (body) (body))
-    Cell* pLambda(Cell::Pair(Cell::Symbol(Sym::Symbol("_lambda")), nullptr));
+    Cell* pLambda(Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::LambdaForm)), nullptr));
+    CellRoot lambdaRoot(pLambda);
     pLambda->Append(pArgs);
  
     Cell* pBody = cell->Cdr()->Cdr();
@@ -212,7 +216,7 @@ Cell* Parser::Parse_Lambda(Cell* cell)
     else
     {
         // Append all the body arguments as a begin
-        Cell* pBegin = Cell::Pair(Cell::Symbol(Sym::Symbol("_begin")));
+        Cell* pBegin = Cell::Pair(Cell::Symbol(Sym::FormSymbol(Sym::BeginForm)));
         pBegin = AppendCells(pBody, pBegin);
         pBegin = Parse_Cell(pBegin);
 
@@ -235,6 +239,9 @@ Cell* Parser::Parse_Cells(Cell* cell, bool topLevel)
 // Parse a cell
 Cell* Parser::Parse_Cell(Cell* cell, bool topLevel)
 {   
+    CellRoot cellRoot(cell);
+    CellAllocator::Instance().SafePoint();
+
     // Parse the cells and check for errors along the way.
     if (cell->IsPair())
     {
@@ -246,35 +253,25 @@ Cell* Parser::Parse_Cell(Cell* cell, bool topLevel)
         }
         else if (cell->Car()->GetType() & Cell::SymbolType)
         {
-            const Sym* symbol = cell->Car()->GetSymbol();
-            if (symbol == Sym::Symbol("_quote"))
+            switch (cell->Car()->GetSymbol()->GetForm())
             {
+            case Sym::QuoteForm:
                 return Parse_Quote(cell);
-            }
-            else if (symbol == Sym::Symbol("_if"))
-            {
+            case Sym::IfForm:
                 return Parse_If(cell);
-            }
-            else if (symbol == Sym::Symbol("_set!"))
-            {
+            case Sym::SetForm:
                 return Parse_Set(cell);
-            }
-            else if (symbol == Sym::Symbol("_begin"))
-            {
+            case Sym::BeginForm:
                 return Parse_Begin(cell, topLevel);
-            }
-            else if (symbol == Sym::Symbol("_define"))
-            {
+            case Sym::DefineForm:
                 return Parse_Define(cell,topLevel);
-            }
-            else if (symbol == Sym::Symbol("_lambda"))
-            {
+            case Sym::LambdaForm:
                 return Parse_Lambda(cell);
-            }
-            else if (symbol == Sym::Symbol("_quasiquote"))
-            {
+            case Sym::QuasiquoteForm:
                 THROW_ERROR_IF(cell->Length() != 2, cell, "Quasiquote does not take " << cell->Length() << " arguments");
                 return Parse_Quasiquote(cell->Cdr());
+            default:
+                break;
             }
         }
     }
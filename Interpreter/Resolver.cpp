@@ -0,0 +1,342 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+#include "pch.h"
+#include "Resolver.h"
+#include "Cell.h"
+#include "CellAllocator.h"
+#include "Evaluator.h"
+#include "Scope.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+// Nothing here is a safe point, so the code doesn't need rooting while it is changed
+Cell* Resolver::Resolve(Cell* cell)
+{
+    _lambdas.clear();
+    return Resolve_Cell(cell);
+}
+
+// Returns the cell to use in place of this one
+Cell* Resolver::Resolve_Cell(Cell* cell)
+{
+    if (cell == nullptr)
+    {
+        return cell;
+    }
+
+    if (cell->GetType() & Cell::SymbolType)
+    {
+        LocalAddress address;
+        if (!_lambdas.empty() && Lookup(cell, _lambdas.size() - 1, address))
+        {
+            return Cell::Local(cell, address.depth, address.index, address.boxed != 0);
+        }
+        return Cell::Global(cell, _pScheme->GetGlobalScope()->FindBinding(cell->GetSymbol()));
+    }
+
+    if (!cell->IsPair() || cell->IsNull())
+    {
+        return cell;
+    }
+
+    Cell* pHead = cell->Car();
+    switch ((pHead->GetType() & Cell::SymbolType) ? pHead->GetSymbol()->GetForm() : Sym::NoForm)
+    {
+    case Sym::QuoteForm:
+    case Sym::QuasiquoteForm:
+        break;
+    case Sym::LambdaForm:
+        Resolve_Lambda(cell);
+        break;
+    case Sym::SetForm:
+    case Sym::DefineForm:
+        if (cell->Cdr() != nullptr && cell->Cdr()->Car() != nullptr)
+        {
+            Cell* pTarget = Resolve_Target(cell->Cdr()->Car(), pHead->GetSymbol()->GetForm() == Sym::DefineForm);
+            if (pTarget != cell->Cdr()->Car())
+            {
+                cell->Cdr()->SetCar(pTarget);
+                CellAllocator::Instance().WriteBarrier(cell->Cdr(), pTarget);
+            }
+            Resolve_Cells(cell->Cdr()->Cdr());
+        }
+        break;
+    case Sym::NoForm:
+        Resolve_Cells(cell);
+        break;
+    default:
+        Resolve_Cells(cell->Cdr());
+        break;
+    }
+    return cell;
+}
+
+// Resolve each entry of a list, replacing those that change
+void Resolver::Resolve_Cells(Cell* pList)
+{
+    while (pList != nullptr && pList->IsPair() && pList->Car() != nullptr)
+    {
+        Cell* pCar = pList->Car();
+        Cell* pResolved = Resolve_Cell(pCar);
+        if (pResolved != pCar)
+        {
+            pList->SetCar(pResolved);
+            CellAllocator::Instance().WriteBarrier(pList, pResolved);
+        }
+        pList = pList->Cdr();
+    }
+}
+
+// (_lambda params body...)
+// The defines in the body are found first, so that they can be referred to before they are reached.
+// A variable is boxed if a closure captures it, and it is either set, or defined in the body, where a closure
+// could capture it before it is defined, parameters included.
+void Resolver::Resolve_Lambda(Cell* cell)
+{
+    if (cell->Cdr() == nullptr || cell->Car()->GetLambdaInfo() != nullptr)
+    {
+        return;
+    }
+
+    LambdaFrame frame;
+    Cell* pParams = cell->Cdr()->Car();
+    if (pParams != nullptr && (pParams->GetType() & Cell::SymbolType))
+    {
+        frame.slots.push_back(pParams->GetSymbol());
+    }
+    else
+    {
+        for (Cell* pParam = pParams; pParam != nullptr && pParam->IsPair() && pParam->Car() != nullptr; pParam = pParam->Cdr())
+        {
+            if (pParam->Car()->GetType() & Cell::SymbolType)
+            {
+                frame.slots.push_back(pParam->Car()->GetSymbol());
+            }
+        }
+    }
+
+    // A parameter can be defined again in the body, so it is looked for here too
+    Cell* pBody = cell->Cdr()->Cdr();
+    tFrame defined;
+    for (Cell* pCurrent = pBody; pCurrent != nullptr && pCurrent->IsPair() && pCurrent->Car() != nullptr; pCurrent = pCurrent->Cdr())
+    {
+        FindDefines(pCurrent->Car(), defined);
+    }
+    for (auto pName : defined)
+    {
+        if (std::find(frame.slots.begin(), frame.slots.end(), pName) == frame.slots.end())
+        {
+            frame.slots.push_back(pName);
+        }
+    }
+
+    tFrame captured;
+    tFrame set;
+    FindCaptured(pBody, false, captured, set);
+    for (auto pSymbol : frame.slots)
+    {
+        bool isCaptured = std::find(captured.begin(), captured.end(), pSymbol) != captured.end();
+        bool isSet = std::find(set.begin(), set.end(), pSymbol) != set.end();
+        bool isDefined = std::find(defined.begin(), defined.end(), pSymbol) != defined.end();
+        frame.boxed.push_back(isCaptured && (isSet || isDefined));
+    }
+
+    _lambdas.push_back(frame);
+    Resolve_Cells(pBody);
+
+    // (captures boxed), on a head of its own; the code is added when it is compiled
+    Cell* pCaptures = Cell::EmptyList();
+    for (auto pSource : _lambdas.back().sources)
+    {
+        pCaptures = pCaptures->Append(pSource);
+    }
+    Cell* pBoxed = Cell::EmptyList();
+    for (size_t slot = 0; slot < _lambdas.back().boxed.size(); slot++)
+    {
+        if (_lambdas.back().boxed[slot])
+        {
+            pBoxed = pBoxed->Append(Cell::Integer(tCellInteger(slot)));
+        }
+    }
+    _lambdas.pop_back();
+
+    Cell* pHead = Cell::LambdaHead(Cell::Pair(pCaptures, Cell::Pair(pBoxed)));
+    cell->SetCar(pHead);
+    CellAllocator::Instance().WriteBarrier(cell, pHead);
+}
+
+// A variable defined in a lambda is always in its frame; a set one can be anywhere
+Cell* Resolver::Resolve_Target(Cell* pTarget, bool define)
+{
+    if (!(pTarget->GetType() & Cell::SymbolType))
+    {
+        return pTarget;
+    }
+
+    LocalAddress address;
+    if (!_lambdas.empty() && Lookup(pTarget, _lambdas.size() - 1, address))
+    {
+        return (define && address.depth != 0) ? pTarget : Cell::Local(pTarget, address.depth, address.index, address.boxed != 0);
+    }
+    if (define && !_lambdas.empty())
+    {
+        return pTarget;
+    }
+    return Cell::Global(pTarget, _pScheme->GetGlobalScope()->FindBinding(pTarget->GetSymbol()));
+}
+
+// Add the variables defined in an expression to a frame, without looking inside quotes or other lambdas
+void Resolver::FindDefines(Cell* cell, tFrame& frame)
+{
+    if (cell == nullptr || !cell->IsPair() || cell->IsNull())
+    {
+        return;
+    }
+
+    Cell* pHead = cell->Car();
+    switch ((pHead->GetType() & Cell::SymbolType) ? pHead->GetSymbol()->GetForm() : Sym::NoForm)
+    {
+    case Sym::QuoteForm:
+    case Sym::QuasiquoteForm:
+    case Sym::LambdaForm:
+        return;
+    case Sym::DefineForm:
+        if (cell->Cdr() != nullptr && cell->Cdr()->Car() != nullptr)
+        {
+            // Already resolved, if this is the second time round
+            Cell* pTarget = cell->Cdr()->Car();
+            const Sym* pName = nullptr;
+            if (pTarget->GetType() & Cell::LocalType)
+            {
+                pName = pTarget->GetVariableSymbol();
+            }
+            else if (pTarget->GetType() & Cell::SymbolType)
+            {
+                pName = pTarget->GetSymbol();
+            }
+            if (pName != nullptr && std::find(frame.begin(), frame.end(), pName) == frame.end())
+            {
+                frame.push_back(pName);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    for (Cell* pCurrent = cell; pCurrent != nullptr && pCurrent->IsPair() && pCurrent->Car() != nullptr; pCurrent = pCurrent->Cdr())
+    {
+        FindDefines(pCurrent->Car(), frame);
+    }
+}
+
+// Find the variables used inside lambdas in some code, and those set anywhere in it.  Shadowing is ignored, so
+// this can find more than there are, which only costs a box.
+void Resolver::FindCaptured(Cell* cell, bool inLambda, tFrame& captured, tFrame& set) const
+{
+    if (cell == nullptr)
+    {
+        return;
+    }
+
+    if (cell->GetType() & Cell::SymbolType)
+    {
+        if (inLambda && std::find(captured.begin(), captured.end(), cell->GetSymbol()) == captured.end())
+        {
+            captured.push_back(cell->GetSymbol());
+        }
+        return;
+    }
+
+    if (!cell->IsPair() || cell->IsNull())
+    {
+        return;
+    }
+
+    Cell* pHead = cell->Car();
+    switch ((pHead->GetType() & Cell::SymbolType) ? pHead->GetSymbol()->GetForm() : Sym::NoForm)
+    {
+    case Sym::QuoteForm:
+    case Sym::QuasiquoteForm:
+        return;
+    case Sym::LambdaForm:
+        inLambda = true;
+        break;
+    case Sym::SetForm:
+        if (cell->Cdr() != nullptr && cell->Cdr()->Car() != nullptr && (cell->Cdr()->Car()->GetType() & Cell::SymbolType))
+        {
+            set.push_back(cell->Cdr()->Car()->GetSymbol());
+        }
+        break;
+    default:
+        break;
+    }
+
+    for (Cell* pCurrent = cell; pCurrent != nullptr && pCurrent->IsPair() && pCurrent->Car() != nullptr; pCurrent = pCurrent->Cdr())
+    {
+        FindCaptured(pCurrent->Car(), inLambda, captured, set);
+    }
+}
+
+// Find a variable as seen from the lambda at the given level: in its frame, or among the values it captures.
+// One from further out is captured by each lambda on the way in.
+bool Resolver::Lookup(Cell* pSymbol, size_t level, LocalAddress& address)
+{
+    LambdaFrame& frame = _lambdas[level];
+    const Sym* pName = pSymbol->GetSymbol();
+
+    auto itr = std::find(frame.slots.begin(), frame.slots.end(), pName);
+    if (itr != frame.slots.end())
+    {
+        address.depth = 0;
+        address.index = uint32_t(itr - frame.slots.begin());
+        address.boxed = frame.boxed[address.index] ? 1 : 0;
+        return true;
+    }
+
+    itr = std::find(frame.captures.begin(), frame.captures.end(), pName);
+    if (itr != frame.captures.end())
+    {
+        address.depth = 1;
+        address.index = uint32_t(itr - frame.captures.begin());
+        address.boxed = frame.capturedBoxed[address.index] ? 1 : 0;
+        return true;
+    }
+
+    LocalAddress outer;
+    if (level == 0 || !Lookup(pSymbol, level - 1, outer))
+    {
+        return false;
+    }
+    frame.sources.push_back(Cell::Local(pSymbol, outer.depth, outer.index, outer.boxed != 0));
+    frame.captures.push_back(pName);
+    frame.capturedBoxed.push_back(outer.boxed != 0);
+
+    address.depth = 1;
+    address.index = uint32_t(frame.captures.size() - 1);
+    address.boxed = outer.boxed;
+    return true;
+}
+
+} // Scheme
+} // Jorvik
@@ -0,0 +1,81 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+#pragma once
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+class Evaluator;
+class Cell;
+class Sym;
+struct LocalAddress;
+
+// Gives the variable references in parsed code lexical addresses.
+// Each lambda has a frame, with a slot for each of its parameters, then one for each variable defined in its body.
+// Closures are flat: a lambda that refers to a variable of a lambda around it captures it, copying it into a
+// frame of its own when the closure is made.  So a local cell is either at depth 0, for the call's frame, or at
+// depth 1, for the captured values, along with its slot.  Any other symbol is replaced by a global cell, pointing
+// at its binding in the global scope.
+// A captured variable that could change after it is captured is boxed, so that everything sees the change.
+// What the interpreter needs to make the closure is kept on the lambda form's head; see Cell::LambdaHead.
+// The code is changed in place.  Quoted data is left alone, and resolving code again changes nothing.
+class Resolver
+{
+public:
+    Resolver(Evaluator* pScheme)
+        : _pScheme(pScheme)
+    {
+    }
+
+    Cell* Resolve(Cell* cell);
+
+private:
+    typedef std::vector<const Sym*> tFrame;
+
+    // A lambda being resolved: the variables in its frame, and the ones it captures from the lambdas around it,
+    // along with the local cells that find those where the closure is made
+    struct LambdaFrame
+    {
+        tFrame slots;
+        std::vector<bool> boxed;
+        tFrame captures;
+        std::vector<bool> capturedBoxed;
+        std::vector<Cell*> sources;
+    };
+
+    Cell* Resolve_Cell(Cell* cell);
+    void Resolve_Cells(Cell* pList);
+    void Resolve_Lambda(Cell* cell);
+    Cell* Resolve_Target(Cell* pTarget, bool define);
+    void FindDefines(Cell* cell, tFrame& frame);
+    void FindCaptured(Cell* cell, bool inLambda, tFrame& captured, tFrame& set) const;
+    bool Lookup(Cell* pSymbol, size_t level, LocalAddress& address);
+
+private:
+    Evaluator* _pScheme;
+
+    // The lambdas being resolved, innermost last
+    std::vector<LambdaFrame> _lambdas;
+};
+
+} // Scheme
+} // Jorvik
@@ -22,6 +22,7 @@
 #include "Cell.h"
 #include "Scope.h"
 #include "Errors.h"
+#include "CellAllocator.h"
 
 namespace Jorvik
 {
@@ -30,18 +31,42 @@ namespace Scheme
 {
 
 Scope::Scope()
-    : _pOuter(nullptr)
+    : _pOuter(nullptr),
+    _mark(CellAllocator::YoungMark),
+    _remembered(false),
+    _rememberedIndex(0),
+    _young(false),
+    _pPrevFrame(nullptr),
+    _pNextFrame(nullptr)
 {
 
 }
 
 Scope::~Scope()
 {
+    Clear();
+}
 
+// Ready to be used again, by a frame from the pool
+void Scope::Clear()
+{
+    if (_remembered)
+    {
+        CellAllocator::Instance().ForgetScope(this);
+    }
+    for (auto& var : _variables)
+    {
+        var.first->Release();
+    }
+    _variables.clear();
+    _slots.clear();
+    _pOuter = nullptr;
+    _mark = CellAllocator::YoungMark;
 }
 
-Scope::Scope(Cell* params, Cell* args, Scope* pOuter)
-    : _pOuter(pOuter)
+// A slot for each parameter; variadic parameters get a single slot, holding a list.
+// Slots for internal defines are added when they are defined.
+void Scope::Bind(Cell* params, Cell* args)
 {
     Cell* pCurrentArg = args;
   
@@ -55,11 +80,11 @@ Scope::Scope(Cell* params, Cell* args, Scope* pOuter)
         {
             if (!pCurrentArg || pCurrentArg->IsNull())
             {
-                AddVariable(pCurrentParam->Car()->GetSymbol(), Cell::EmptyList());
+                SetSlot((unsigned int)_slots.size(), Cell::EmptyList());
             }
             else
             {
-                AddVariable(pCurrentParam->Car()->GetSymbol(), pCurrentArg->Car());
+                SetSlot((unsigned int)_slots.size(), pCurrentArg->Car());
             }
             pCurrentParam = pCurrentParam->Cdr();
             if (pCurrentArg)
@@ -78,19 +103,62 @@ Scope::Scope(Cell* params, Cell* args, Scope* pOuter)
             pNewList = pNewList->Append(pCurrentArg->Car());
             pCurrentArg = pCurrentArg->Cdr();
         }
-        AddVariable(params->GetSymbol(), pNewList);
+        SetSlot(0, pNewList);
+    }
+}
+
+void Scope::BoxSlots(const std::vector<unsigned int>& slots)
+{
+    for (auto index : slots)
+    {
+        SetSlot(index, Cell::Box(GetSlot(index)));
+    }
+}
+
+Scope* Scope::Capture(const std::vector<LocalAddress>& captures)
+{
+    if (captures.empty())
+    {
+        return nullptr;
     }
+
+    Scope* pCaptured = CellAllocator::Instance().AllocFrame();
+    for (unsigned int index = 0; index < captures.size(); index++)
+    {
+        pCaptured->SetSlot(index, GetFrame(captures[index].depth)->GetSlot(captures[index].index));
+    }
+    return pCaptured;
 }
 
 void Scope::AddVariable(const Sym* sym, Cell* cell)
 {
-    _variables[sym] = cell;
+    CellAllocator::Instance().WriteBarrier(this, cell);
+    auto result = _variables.insert(std::make_pair(sym, cell));
+    if (result.second)
+    {
+        // The scope keeps its symbols alive
+        sym->AddRef();
+    }
+    else
+    {
+        result.first->second = cell;
+    }
+}
+
+void Scope::SetSlot(unsigned int index, Cell* cell)
+{
+    CellAllocator::Instance().WriteBarrier(this, cell);
+    if (index >= _slots.size())
+    {
+        _slots.resize(index + 1, nullptr);
+    }
+    _slots[index] = cell;
 }
 
 Cell* Scope::FindVariable(const Sym* sym)
 {
     auto itr = _variables.find(sym);
-    if (itr != std::end(_variables))
+    if (itr != std::end(_variables) && itr->second != nullptr)
     {
         return itr->second;
     }
@@ -101,10 +169,46 @@ Cell* Scope::FindVariable(const Sym* sym)
     return nullptr;
 }
 
+// Made unbound if it isn't there yet, so code can refer to a global before it is defined
+Cell** Scope::FindBinding(const Sym* sym)
+{
+    auto result = _variables.insert(std::make_pair(sym, (Cell*)nullptr));
+    if (result.second)
+    {
+        sym->AddRef();
+    }
+    return &result.first->second;
+}
+
+void Scope::SetBinding(Cell** ppBinding, Cell* cell)
+{
+    CellAllocator::Instance().WriteBarrier(this, cell);
+    *ppBinding = cell;
+}
+
+// Every global cell keeps a symbol cell for its name alive, so an unbound global whose symbol has no references
+// but the binding's own has nothing left pointing at it.
+void Scope::PruneBindings()
+{
+    for (auto itr = _variables.begin(); itr != _variables.end();)
+    {
+        const Sym* pSym = itr->first;
+        if (itr->second == nullptr && pSym->GetRefCount() == 1 && !pSym->IsPinned())
+        {
+            pSym->Release();
+            itr = _variables.erase(itr);
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+}
+
 bool Scope::SetVariable(const Sym* sym, Cell* cell)
 {
     auto itr = _variables.find(sym);
-    if (itr == std::end(_variables))
+    if (itr == std::end(_variables) || itr->second == nullptr)
     {
         if (_pOuter != nullptr)
         {
@@ -112,6 +216,7 @@ bool Scope::SetVariable(const Sym* sym, Cell* cell)
         }
         return false;
     }
+    CellAllocator::Instance().WriteBarrier(this, cell);
     itr->second = cell;
     return true;
 }
@@ -122,6 +227,10 @@ std::ostream& operator << (std::ostream& stream, const Scope& scope)
     stream << "Scope " << &scope << ", Variables: " << scope._variables.size() << std::endl;
     for(auto var : scope._variables)
     {
+        if (var.second == nullptr)
+        {
+            continue;
+        }
         stream << (std::string)*var.first;
         if (!var.second->ToString().empty())
         {
@@ -137,6 +246,10 @@ std::ostream& operator << (std::ostream& stream, const Scope& scope)
         }
         stream << std::endl;
     }
+    for (size_t index = 0; index < scope._slots.size(); index++)
+    {
+        stream << "[" << index << "] : " << (scope._slots[index] ? scope._slots[index]->ToString() : "<undefined>") << std::endl;
+    }
     if (scope._pOuter)
     {
         stream << std::endl << "Parent Scope: " << std::endl << *scope._pOuter;
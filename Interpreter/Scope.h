@@ -26,27 +26,79 @@ namespace Scheme
 {
 
 class Sym;
+class CellAllocator;
+class HeapImage;
+struct LocalAddress;
 
-// A variable scope, containing a list of symbol->cell bindings.
+// A variable scope.  The global scope binds symbols to cells, which resolved code refers to directly.
+// A lambda call gets a frame instead: its arguments, then its internal defines, in slots found by the lexical
+// addresses the resolver gave the references to them.  Its outer scope is another frame, holding the values the
+// closure captured.
+// Frames belong to the heap, and are passed around as plain pointers.  A call's frame comes off the heap's stack;
+// a closure's captured values are kept alive by the collector, like a cell.
 class Scope
 {
 public:
     Scope();
-    Scope(Cell* params, Cell* args, Scope* pOuter);
     ~Scope();
     void AddVariable(const Sym* sym, Cell* cell);
     Cell* FindVariable(const Sym* sym);
     bool SetVariable(const Sym* sym, Cell* cell);
 
+    // Bindings in the map never move, so code can hold on to one found here, and see it change.
+    // An unbound one is null.
+    Cell** FindBinding(const Sym* sym);
+    void SetBinding(Cell** ppBinding, Cell* cell);
+
+    // Forget the unbound globals that no code refers to any more, so the names can be collected
+    void PruneBindings();
+
     typedef std::map<const Sym*, Cell* > tmapSymbolToCell;
     const tmapSymbolToCell& GetSymbols() const { return _variables; }
 
+    // Fill in a new frame's slots from a lambda's parameters and its arguments
+    void Bind(Cell* params, Cell* args);
+
+    // Boxed slots get their boxes as soon as the frame is bound, so closures can capture them before they are defined
+    void BoxSlots(const std::vector<unsigned int>& slots);
+
+    // A new closure's frame, holding copies of the values it captures, as seen from here.  A boxed value's box is
+    // copied, not what is in it.  Null if it captures nothing.
+    Scope* Capture(const std::vector<LocalAddress>& captures);
+
+    // The scope 'depth' out from this one
+    Scope* GetFrame(unsigned int depth)
+    {
+        Scope* pScope = this;
+        while (depth-- != 0)
+        {
+            pScope = pScope->_pOuter;
+        }
+        return pScope;
+    }
+
+    // A slot that hasn't been defined yet is null
+    Cell* GetSlot(unsigned int index) const { return index < _slots.size() ? _slots[index] : nullptr; }
+    void SetSlot(unsigned int index, Cell* cell);
+
 private:
+    void Clear();
+
     tmapSymbolToCell _variables;
+    std::vector<Cell*> _slots;
 
     friend std::ostream& operator << (std::ostream& stream, const Scope& scope);
-    int _refCount;
     Scope* _pOuter;
+
+    // Garbage collector state, and the heap's list of frames
+    friend CellAllocator;
+    friend HeapImage;
+    std::atomic<unsigned char> _mark;
+    bool _remembered;
+    unsigned int _rememberedIndex;
+    bool _young;
+    Scope* _pPrevFrame;
+    Scope* _pNextFrame;
 };
 
 }
@@ -0,0 +1,388 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+#include "pch.h"
+
+#include "Symbol.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+// Symbols, and their names, are allocated from chunks of this size.
+// Freed ones are kept on a free list for their size, up to the largest, which get memory of their own.
+static const size_t SymbolChunkSize = 64 * 1024;
+static const size_t SymbolAlign = sizeof(void*);
+static const size_t MaxPooledSymbolSize = 256;
+
+// The table is kept no more than half full, so probe sequences stay short
+static const size_t MinSymbolTableSize = 1024;
+
+// The text of each special form's symbol, as the tokenizer maps it
+static const char* FormNames[Sym::NumForms] = 
+{
+    nullptr,
+    "_quote",
+    "_quasiquote",
+    "_if",
+    "_set!",
+    "_define",
+    "_lambda",
+    "_begin"
+};
+
+// FNV-1a
+static uint32_t HashText(const char* pText, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t index = 0; index < length; index++)
+    {
+        hash ^= (unsigned char)pText[index];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// A heap that collects symbols, and the epochs of its last two collections
+struct SymbolCollector
+{
+    const CellAllocator* pHeap;
+    uint64_t last;
+    uint64_t previous;
+};
+
+struct SymbolTable
+{
+    SymbolTable()
+        : slots(MinSymbolTableSize, nullptr),
+        numSymbols(0),
+        pChunk(nullptr),
+        chunkRemaining(0),
+        epoch(0)
+    {
+        std::fill(std::begin(forms), std::end(forms), nullptr);
+    }
+
+    // Freed symbols go back on the free lists, so only the chunks, and the symbols too big for them, are freed
+    ~SymbolTable()
+    {
+        for (auto pSym : slots)
+        {
+            if (pSym != nullptr && BlockSize(pSym->GetLength()) > MaxPooledSymbolSize)
+            {
+                delete[] (char*)pSym;
+            }
+        }
+        for (auto pMem : chunks)
+        {
+            delete[] pMem;
+        }
+    }
+
+    // Find the slot holding the text, or the empty one where it would go
+    size_t Find(const char* pText, size_t length, uint32_t hash) const
+    {
+        size_t mask = slots.size() - 1;
+        size_t slot = hash & mask;
+        for (;;)
+        {
+            const Sym* pSym = slots[slot];
+            if (pSym == nullptr ||
+                (pSym->GetHash() == hash &&
+                pSym->GetLength() == length &&
+                memcmp(pSym->GetName(), pText, length) == 0))
+            {
+                return slot;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    const Sym* Intern(const char* pText, size_t length);
+
+    void Grow()
+    {
+        Rehash(slots.size() * 2);
+    }
+
+    void Rehash(size_t size)
+    {
+        std::vector<const Sym*> old(size, nullptr);
+        old.swap(slots);
+
+        size_t mask = slots.size() - 1;
+        for (auto pSym : old)
+        {
+            if (pSym != nullptr)
+            {
+                size_t slot = pSym->GetHash() & mask;
+                while (slots[slot] != nullptr)
+                {
+                    slot = (slot + 1) & mask;
+                }
+                slots[slot] = pSym;
+            }
+        }
+    }
+
+    // Keep the Syms aligned
+    static size_t BlockSize(size_t length)
+    {
+        return (sizeof(Sym) + length + 1 + SymbolAlign - 1) & ~(SymbolAlign - 1);
+    }
+
+    char* Allocate(size_t size)
+    {
+        if (size > MaxPooledSymbolSize)
+        {
+            return new char[size];
+        }
+
+        auto& freeList = freeBlocks[size / SymbolAlign];
+        if (!freeList.empty())
+        {
+            char* pMem = freeList.back();
+            freeList.pop_back();
+            return pMem;
+        }
+
+        if (size > chunkRemaining)
+        {
+            pChunk = new char[SymbolChunkSize];
+            chunkRemaining = SymbolChunkSize;
+            chunks.push_back(pChunk);
+        }
+
+        char* pMem = pChunk;
+        pChunk += size;
+        chunkRemaining -= size;
+        return pMem;
+    }
+
+    void Free(const Sym* pSym)
+    {
+        size_t size = BlockSize(pSym->GetLength());
+        pSym->~Sym();
+        if (size > MaxPooledSymbolSize)
+        {
+            delete[] (char*)pSym;
+        }
+        else
+        {
+            freeBlocks[size / SymbolAlign].push_back((char*)pSym);
+        }
+    }
+
+    std::vector<const Sym*> slots;
+    const Sym* forms[Sym::NumForms];
+    size_t numSymbols;
+    char* pChunk;
+    size_t chunkRemaining;
+    std::vector<char*> freeBlocks[MaxPooledSymbolSize / SymbolAlign + 1];
+    std::vector<char*> chunks;
+
+    // Counts collections by any heap
+    uint64_t epoch;
+    std::vector<SymbolCollector> collectors;
+
+    // Evaluators on other threads share the table
+    std::mutex lock;
+};
+
+// Made on first use, since symbols are needed during static initialization
+static SymbolTable& GetSymbolTable()
+{
+    static SymbolTable table;
+    return table;
+}
+
+// With the table locked
+const Sym* SymbolTable::Intern(const char* pText, size_t length)
+{
+    uint32_t hash = HashText(pText, length);
+    size_t slot = Find(pText, length, hash);
+    if (slots[slot] != nullptr)
+    {
+        // Give whoever asked until their heap's next collection to refer to it
+        slots[slot]->_lookedUp = epoch;
+        return slots[slot];
+    }
+
+    // New symbol; the name goes straight after it in the arena
+    char* pMem = Allocate(BlockSize(length));
+    char* pName = pMem + sizeof(Sym);
+    memcpy(pName, pText, length);
+    pName[length] = 0;
+
+    Sym::Form form = Sym::NoForm;
+    for (int index = Sym::NoForm + 1; index < Sym::NumForms; index++)
+    {
+        if (strcmp(pName, FormNames[index]) == 0)
+        {
+            form = Sym::Form(index);
+        }
+    }
+    Sym* pSym = new (pMem) Sym(pName, (uint32_t)length, hash, form, epoch);
+
+    slots[slot] = pSym;
+    if (form != Sym::NoForm)
+    {
+        forms[form] = pSym;
+    }
+    if (++numSymbols * 2 > slots.size())
+    {
+        Grow();
+    }
+    return pSym;
+}
+
+const Sym* Sym::Symbol(const char* pText, size_t length)
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    return table.Intern(pText, length);
+}
+
+// The form symbols are pinned, so once made they stay put
+const Sym* Sym::FormSymbol(Form form)
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    if (table.forms[form] == nullptr)
+    {
+        table.Intern(FormNames[form], strlen(FormNames[form]));
+    }
+    return table.forms[form];
+}
+
+// Under the lock, so a collection on another thread sees it
+void Sym::Pin() const
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    _pinned = true;
+}
+
+bool Sym::IsSymbol(const char* pText, size_t length)
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    return table.slots[table.Find(pText, length, HashText(pText, length))] != nullptr;
+}
+
+// A new heap hasn't looked anything up before now
+void Sym::AddCollector(const CellAllocator* pHeap)
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    SymbolCollector collector = { pHeap, table.epoch, table.epoch };
+    table.collectors.push_back(collector);
+}
+
+void Sym::RemoveCollector(const CellAllocator* pHeap)
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    table.collectors.erase(std::remove_if(table.collectors.begin(), table.collectors.end(), [=](const SymbolCollector& collector)
+    {
+        return collector.pHeap == pHeap;
+    }), table.collectors.end());
+}
+
+// A symbol has to go unreferenced, and not be looked up, for a whole collection by every heap before it is freed;
+// a heap on another thread could be about to refer to one it has just looked up.
+// The survivors are rehashed, since open addressing can't simply empty a slot.
+unsigned int Sym::Collect(const CellAllocator* pHeap)
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+
+    uint64_t horizon = ++table.epoch;
+    for (auto& collector : table.collectors)
+    {
+        if (collector.pHeap == pHeap)
+        {
+            collector.previous = collector.last;
+            collector.last = table.epoch;
+        }
+        horizon = std::min(horizon, collector.previous);
+    }
+
+    unsigned int numFreed = 0;
+    for (auto& pSym : table.slots)
+    {
+        if (pSym == nullptr || 
+            pSym->_pinned ||
+            pSym->_refs != 0 ||
+            pSym->_lookedUp >= horizon)
+        {
+            continue;
+        }
+
+        table.Free(pSym);
+        pSym = nullptr;
+        numFreed++;
+    }
+
+    if (numFreed != 0)
+    {
+        table.numSymbols -= numFreed;
+        size_t size = table.slots.size();
+        while (size > MinSymbolTableSize && table.numSymbols * 4 < size)
+        {
+            size /= 2;
+        }
+        table.Rehash(size);
+    }
+    return numFreed;
+}
+
+unsigned int Sym::GetCount()
+{
+    SymbolTable& table = GetSymbolTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    return (unsigned int)table.numSymbols;
+}
+
+// In name order
+void Sym::Dump()
+{
+    SymbolTable& table = GetSymbolTable();
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> guard(table.lock);
+        for (auto pSym : table.slots)
+        {
+            if (pSym != nullptr)
+            {
+                names.push_back(*pSym);
+            }
+        }
+    }
+    std::sort(names.begin(), names.end());
+
+    for (auto& name : names)
+    {
+        std::cout << name << std::endl;
+    }
+}
+
+} // Scheme
+} // Jorvik
@@ -17,66 +17,115 @@
 // 2. Altered source versions must be plainly marked as such, and must not be
 //    misrepresented as being the original software.
 // 3. This notice may not be removed or altered from any source distribution.
-//
 #pragma once
 
 #include <string>
+#include <cstring>
+#include <atomic>
 
 namespace Jorvik
 {
 namespace Scheme
 {
 
+class CellAllocator;
+
+// An interned symbol.  There is only ever one Sym for a given name, so symbols are compared by pointer.
+// Symbols, and their names, are carved out of an arena, and found through an open addressed hash table.
+// Looking up text hashes it in place, so only a new symbol copies it.
+// Cells and scopes count their references to a symbol, and full collections free the ones nothing refers to.
+// A symbol looked up from C++ is safe until the next full collection of its heap after that; hold on to it for
+// longer by putting it in a cell, or pin it.
+// The table is shared by the heaps of every evaluator, on whatever thread, so a symbol is only freed once all of
+// them have collected since it was last looked up.  A heap that never collects holds symbols back for everyone.
 class Sym
 {
 public:
-    Sym(const std::string& str) 
-        : _symbol(str)
+    // The special forms.  Their symbols are tagged when interned, so the parser and interpreter can switch on them.
+    enum Form
     {
-    }
+        NoForm,
+        QuoteForm,
+        QuasiquoteForm,
+        IfForm,
+        SetForm,
+        DefineForm,
+        LambdaForm,
+        BeginForm,
+        NumForms
+    };
 
+    static const Sym* Symbol(const char* pText, size_t length);
     static const Sym* Symbol(const char* pszValue) 
     {
-        return Sym::Symbol(std::string(pszValue));
+        return Sym::Symbol(pszValue, strlen(pszValue));
     }
-
     static const Sym* Symbol(const std::string& value)
     {
-        tTextToSymbol::iterator itrFound = MapTextToSymbol.find(value);
-        if (itrFound != MapTextToSymbol.end())
-        {
-            return itrFound->second;
-        }
-        Sym* pSym = new Sym(value);
-        MapTextToSymbol[value] = pSym; 
-        return pSym;
+        return Sym::Symbol(value.data(), value.size());
     }
 
+    static bool IsSymbol(const char* pText, size_t length);
     static bool IsSymbol(const std::string& str)
     {
-        tTextToSymbol::iterator itrFound = MapTextToSymbol.find(str);
-        if (itrFound != MapTextToSymbol.end())
-        {
-            return true;
-        }
-        return false;
+        return IsSymbol(str.data(), str.size());
     }
 
-    static void Dump()
+    static void Dump();
+
+    // Each heap that collects symbols is registered for its lifetime
+    static void AddCollector(const CellAllocator* pHeap);
+    static void RemoveCollector(const CellAllocator* pHeap);
+
+    // Free the symbols nothing has referred to, or looked up, since every heap's collection before last.
+    // Returns how many went.
+    static unsigned int Collect(const CellAllocator* pHeap);
+    static unsigned int GetCount();
+
+    // The symbol for a special form, without looking it up
+    static const Sym* FormSymbol(Form form);
+    Form GetForm() const { return _form; }
+
+    // The name is null terminated, as well as having a length
+    const char* GetName() const { return _pName; }
+    size_t GetLength() const { return _length; }
+    uint32_t GetHash() const { return _hash; }
+
+    operator std::string () const { return std::string(_pName, _length); } 
+
+    // References from cells and scopes, which may come and go on the collector's threads
+    void AddRef() const { _refs++; }
+    void Release() const { _refs--; }
+    uint32_t GetRefCount() const { return _refs; }
+
+    // A pinned symbol is never freed
+    void Pin() const;
+    bool IsPinned() const { return _pinned; }
+
+private:
+    Sym(const char* pName, uint32_t length, uint32_t hash, Form form, uint64_t epoch)
+        : _pName(pName),
+        _length(length),
+        _hash(hash),
+        _form(form),
+        _refs(0),
+        _pinned(form != NoForm),
+        _lookedUp(epoch)
     {
-        for (auto val : MapTextToSymbol)
-        {
-            std::cout << val.first << std::endl;
-        }
     }
 
-    operator const std::string& () const { return _symbol; } 
+    friend struct SymbolTable;
 
-private:
-    typedef std::map<std::string, const Sym*> tTextToSymbol;
-    static tTextToSymbol MapTextToSymbol;
-    std::string _symbol;
+    const char* _pName;
+    uint32_t _length;
+    uint32_t _hash;
+    Form _form;
+    mutable std::atomic<uint32_t> _refs;
+    mutable std::atomic<bool> _pinned;
+
+    // The collection epoch it was last looked up in
+    mutable uint64_t _lookedUp;
 };
 
 } // Scheme
-} // Jorvik
\ No newline at end of file
+} // Jorvik
@@ -30,6 +30,7 @@
 #include "../Parser.h"
 #include "../Errors.h"
 #include "../Scope.h"
+#include "../CellAllocator.h"
 
 #include "googletest/include/gtest/gtest.h"
 #include "googlemock/include/gmock/gmock.h"
@@ -109,6 +110,381 @@ TEST_F(JorvikCell, ConsAListToAListOtherWay)
     
     ASSERT_THAT(pCell->ToString(), StrEq("((3) 0 1 2)"));
 };
+// Small integers and booleans are immediates, and don't use the heap
+TEST_F(JorvikCell, ImmediatesAreNotAllocated)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    unsigned int poolSize = alloc.GetPoolSize();
+    ASSERT_THAT(Cell::Integer(42), Eq(Cell::Integer(42)));
+    ASSERT_THAT(Cell::Integer(Cell::MinFixnum)->GetInteger(), Eq(Cell::MinFixnum));
+    ASSERT_THAT(Cell::Boolean(true), Eq(Cell::Boolean(true)));
+    ASSERT_THAT(Cell::Integer(3)->Add(Cell::Integer(4))->GetInteger(), Eq(7));
+    ASSERT_TRUE(Cell::IsImmediate(Cell::EmptyList()));
+    ASSERT_THAT(alloc.GetPoolSize(), Eq(poolSize));
+
+    Cell* pLarge = Cell::Integer(Cell::MaxFixnum)->Add(Cell::Integer(1));
+    ASSERT_FALSE(Cell::IsImmediate(pLarge));
+    ASSERT_THAT(pLarge->GetInteger(), Eq(Cell::MaxFixnum + 1));
+    ASSERT_THAT(eval.Evaluate("(- (+ 32767 10) 20)")->GetInteger(), Eq(32757));
+    ASSERT_THAT(eval.Evaluate("(< 1 2)")->ToString(), StrEq("#t"));
+};
+// Filling several slabs with garbage, then collecting, should hand the slabs back
+TEST_F(JorvikCell, EmptySlabsAreReleased)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    unsigned int slabs = alloc.GetSlabCount();
+
+    for (unsigned int i = 0; i < alloc.GetCellsPerSlab() * 4; i++)
+    {
+        Cell::Float(tCellFloat(i));
+    }
+    ASSERT_THAT(alloc.GetSlabCount(), Gt(slabs));
+
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(alloc.GetSlabCount(), Le(slabs));
+    ASSERT_THAT(eval.Evaluate("(list 1 2 3)")->ToString(), StrEq("(1 2 3)"));
+};
+
+// Free slabs beyond the retained number give their memory back to the OS after a collection
+TEST_F(JorvikCell, FreeSlabMemoryIsReturned)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    unsigned int retained = alloc.GetRetainedSlabs();
+    alloc.SetRetainedSlabs(0);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    unsigned int resident = alloc.GetResidentSlabCount();
+    unsigned int regions = alloc.GetRegionCount();
+
+    for (unsigned int i = 0; i < alloc.GetCellsPerSlab() * 80; i++)
+    {
+        Cell::Float(tCellFloat(i));
+    }
+    ASSERT_THAT(alloc.GetResidentSlabCount(), Gt(resident));
+    ASSERT_THAT(alloc.GetRegionCount(), Gt(regions));
+
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(alloc.GetResidentSlabCount(), Le(resident));
+    ASSERT_THAT(alloc.GetResidentSlabCount(), Eq(alloc.GetSlabCount()));
+    ASSERT_THAT(alloc.GetRegionCount(), Le(regions));
+    ASSERT_THAT(eval.Evaluate("(list 1 2 3)")->ToString(), StrEq("(1 2 3)"));
+
+    alloc.SetRetainedSlabs(retained);
+};
+// A young collection frees the garbage, but keeps anything the old generation points at
+TEST_F(JorvikCell, YoungCollectionKeepsReachableCells)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+
+    eval.Evaluate("(define x (list 1 2 3))");
+    unsigned int live = alloc.GetPoolSize();
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        Cell::Integer(i);
+    }
+
+    alloc.GarbageCollect(eval.GetGlobalScope());
+    ASSERT_THAT(alloc.GetNurserySize(), Eq(0u));
+    ASSERT_THAT(alloc.GetPoolSize(), Le(live));
+    ASSERT_THAT(eval.Evaluate("x")->ToString(), StrEq("(1 2 3)"));
+};
+
+// Values only held by a closure's scope must survive collection
+TEST_F(JorvikCell, CollectionKeepsClosureScopes)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    eval.Evaluate("(define ((account bal) amt) (set! bal (+ bal amt)) bal)");
+    eval.Evaluate("(define a1 (account 100))");
+    alloc.GarbageCollect(eval.GetGlobalScope());
+    ASSERT_THAT(eval.Evaluate("(a1 10)")->ToString(), StrEq("110"));
+    alloc.GarbageCollect(eval.GetGlobalScope());
+    ASSERT_THAT(eval.Evaluate("(a1 10)")->ToString(), StrEq("120"));
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(eval.Evaluate("(a1 10)")->ToString(), StrEq("130"));
+};
+// With a tiny threshold, long running expressions collect as they go and keep their live data
+TEST_F(JorvikCell, CollectsDuringEvaluation)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    unsigned int threshold = alloc.GetCollectThreshold();
+    alloc.SetCollectThreshold(64);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+
+    eval.Evaluate("(define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc 1))))");
+    eval.Evaluate("(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))");
+    ASSERT_THAT(eval.Evaluate("(count 20000 0)")->ToString(), StrEq("20000"));
+    ASSERT_THAT(alloc.GetSlabCount(), Lt(8u));
+    ASSERT_THAT(eval.Evaluate("(length (build 5000 '()))")->ToString(), StrEq("5000"));
+    ASSERT_THAT(eval.Evaluate("(list (car (build 3 '())) (+ 1 2) '(4 5))")->ToString(), StrEq("(1 3 (4 5))"));
+
+    alloc.SetCollectThreshold(threshold);
+};
+// Marking a very long list shouldn't need a deep C++ stack
+TEST_F(JorvikCell, CollectsLongLists)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    Cell* pList = Cell::EmptyList();
+    for (unsigned int i = 0; i < 500000; i++)
+    {
+        pList = Cell::Pair(Cell::Integer(i), pList);
+    }
+    eval.GetGlobalScope()->AddVariable(Sym::Symbol("long-list"), pList);
+
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(eval.Evaluate("(length long-list)")->GetInteger(), Eq(500000));
+    ASSERT_THAT(eval.Evaluate("(car long-list)")->GetInteger(), Eq(499999));
+};
+// A full collection spread across safe points must not lose anything the program changes while it runs
+TEST_F(JorvikCell, CollectsIncrementally)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    unsigned int threshold = alloc.GetCollectThreshold();
+    alloc.SetCollectThreshold(64);
+    alloc.SetPauseBudget(1);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+
+    eval.Evaluate("(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))");
+    eval.Evaluate("(define (make-counter n) (lambda () (set! n (+ n 1)) n))");
+    eval.Evaluate("(define counter (make-counter 0))");
+    eval.Evaluate("(define old (build 20000 '()))");
+
+    bool collected = false;
+    for (int i = 0; i < 50; i++)
+    {
+        eval.Evaluate("(set! old (cons (counter) old))");
+        eval.Evaluate("(define young (build 500 '()))");
+        collected |= alloc.IsCollecting();
+    }
+    ASSERT_TRUE(collected);
+    ASSERT_THAT(eval.Evaluate("(counter)")->GetInteger(), Eq(51));
+    ASSERT_THAT(eval.Evaluate("(length old)")->GetInteger(), Eq(20050));
+    ASSERT_THAT(eval.Evaluate("(car old)")->GetInteger(), Eq(50));
+    ASSERT_THAT(eval.Evaluate("(length young)")->GetInteger(), Eq(500));
+
+    alloc.SetPauseBudget(0);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_FALSE(alloc.IsCollecting());
+    ASSERT_THAT(eval.Evaluate("(length old)")->GetInteger(), Eq(20050));
+    alloc.SetCollectThreshold(threshold);
+};
+// Marking and sweeping with several threads should find exactly what one thread does
+TEST_F(JorvikCell, CollectsInParallel)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    alloc.SetThreadCount(4);
+
+    eval.Evaluate("(define (build n acc) (if (= n 0) acc (build (- n 1) (cons (list n (lambda () n)) acc))))");
+    eval.Evaluate("(define kept (build 20000 '()))");
+    eval.Evaluate("(build 20000 '())");
+
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    unsigned int poolSize = alloc.GetPoolSize();
+    ASSERT_THAT(eval.Evaluate("(length kept)")->GetInteger(), Eq(20000));
+    ASSERT_THAT(eval.Evaluate("((car (cdr (car kept))))")->GetInteger(), Eq(1));
+
+    alloc.SetThreadCount(1);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(alloc.GetPoolSize(), Eq(poolSize));
+};
+// The copying collector should leave a list's spine in consecutive cells, and everything still working
+TEST_F(JorvikCell, CompactsLists)
+{
+    CellAllocator& alloc = CellAllocator::Instance();
+    alloc.SetCompacting(true);
+
+    eval.Evaluate("(define (build n acc) (if (= n 0) acc (build (- n 1) (cons (list n \"s\") acc))))");
+    eval.Evaluate("(define (make-adder n) (lambda (x) (+ x n)))");
+    eval.Evaluate("(define add2 (make-adder 2))");
+    eval.Evaluate("(define kept (build 1000 '()))");
+    eval.Evaluate("(build 50000 '())");
+
+    unsigned int slabs = alloc.GetSlabCount();
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    alloc.SetCompacting(false);
+    ASSERT_THAT(alloc.GetSlabCount(), Lt(slabs));
+
+    Cell* pCell = eval.GetGlobalScope()->FindVariable(Sym::Symbol("kept"));
+    unsigned int contiguous = 0;
+    for (; pCell->Cdr() != nullptr; pCell = pCell->Cdr())
+    {
+        if (pCell->Cdr() == pCell + 1)
+        {
+            contiguous++;
+        }
+    }
+    ASSERT_THAT(contiguous, Gt(990u));
+
+    ASSERT_THAT(eval.Evaluate("(length kept)")->GetInteger(), Eq(1000));
+    ASSERT_THAT(eval.Evaluate("(car (cdr (car kept)))")->ToString(), StrEq("\"s\""));
+    ASSERT_THAT(eval.Evaluate("(add2 40)")->GetInteger(), Eq(42));
+    ASSERT_THAT(eval.Evaluate("(length '())")->GetInteger(), Eq(0));
+};
+
+// Each evaluator collects its own heap, without touching another's cells
+TEST_F(JorvikCell, EvaluatorsHaveTheirOwnHeaps)
+{
+    Evaluator other;
+    eval.Evaluate("(define x (list 1 2 3))");
+    other.Evaluate("(define y (list 4 5 6))");
+    ASSERT_THAT(&other.GetHeap(), Ne(&eval.GetHeap()));
+
+    unsigned int otherLive = other.GetHeap().GetPoolSize();
+    eval.GetHeap().GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(other.GetHeap().GetPoolSize(), Eq(otherLive));
+
+    other.GetHeap().GarbageCollect(other.GetGlobalScope(), true);
+    ASSERT_THAT(eval.Evaluate("x")->ToString(), StrEq("(1 2 3)"));
+    ASSERT_THAT(other.Evaluate("y")->ToString(), StrEq("(4 5 6)"));
+};
+
+// A runaway evaluation is stopped at the heap limit, leaving the evaluator usable
+TEST_F(JorvikCell, HeapLimitStopsRunawayEvaluation)
+{
+    eval.Evaluate("(define (grow l n) (if (= n 0) l (grow (cons n l) (- n 1))))");
+    eval.SetCellLimit(eval.GetHeap().GetPoolSize() + 10000);
+
+    ASSERT_THROW(eval.Evaluate("(grow '() 100000)"), heap_limit_error);
+    ASSERT_THAT(eval.GetPeakCells(), Le(eval.GetCellLimit() * 2));
+
+    ASSERT_THAT(eval.Evaluate("(length (grow '() 1000))")->GetInteger(), Eq(1000));
+    ASSERT_THAT(eval.GetPeakCells(), Gt(1000u));
+    ASSERT_THAT(eval.GetPeakCells(), Le(eval.GetCellLimit() * 2));
+};
+
+// Garbage is collected to stay under the limit, rather than counting against it
+TEST_F(JorvikCell, HeapLimitCollectsFirst)
+{
+    eval.Evaluate("(define (churn n l) (if (= n 0) n (churn (- n 1) (list 1 2 3 4))))");
+    eval.SetCellLimit(eval.GetHeap().GetPoolSize() + 10000);
+
+    ASSERT_THAT(eval.Evaluate("(churn 20000 (quote ()))")->GetInteger(), Eq(0));
+    ASSERT_THAT(eval.GetPeakCells(), Le(eval.GetCellLimit() * 2));
+};
+
+// Each collection is added to the stats, which are also available to scheme code
+TEST_F(JorvikCell, CollectionStatsAreRecorded)
+{
+    CellAllocator& alloc = eval.GetHeap();
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    alloc.ResetStats();
+
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        Cell::Float(tCellFloat(i));
+    }
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+
+    const GCStats& stats = alloc.GetStats();
+    ASSERT_THAT(stats.pauses, Eq(1u));
+    ASSERT_THAT(stats.bytesAllocated, Eq(1000 * sizeof(Cell)));
+    ASSERT_THAT(stats.cellsFreed, Ge(1000u));
+    ASSERT_THAT(stats.cellsMarked, Gt(0u));
+    ASSERT_THAT(std::accumulate(std::begin(stats.pauseHistogram), std::end(stats.pauseHistogram), 0u), Eq(1u));
+
+    ASSERT_THAT(eval.Evaluate("(car (car (gc-stats)))")->ToString(), StrEq("pauses"));
+    ASSERT_THAT(eval.Evaluate("(cdr (car (gc-stats)))")->GetInteger(), Ge(1));
+};
+
+// A heap image brings back the globals, closures and all, in a new evaluator
+TEST_F(JorvikCell, HeapImageRestoresGlobals)
+{
+    const char* pszImage = "JorvikCellTests.image";
+    eval.Evaluate("(define ((account bal) amt) (set! bal (+ bal amt)) bal)");
+    eval.Evaluate("(define a1 (account 100))");
+    eval.Evaluate("(a1 10)");
+    eval.Evaluate("(define data (list 1.5 \"text\" 100000 'sym car))");
+    eval.SaveImage(pszImage);
+
+    Evaluator loaded(pszImage);
+    std::remove(pszImage);
+
+    ASSERT_THAT(loaded.Evaluate("data")->ToString(), StrEq(eval.Evaluate("data")->ToString()));
+    ASSERT_THAT(loaded.Evaluate("((car (cdr (cdr (cdr (cdr data))))) (list 7 8))")->GetInteger(), Eq(7));
+    ASSERT_THAT(loaded.Evaluate("(a1 10)")->GetInteger(), Eq(120));
+    ASSERT_THAT(eval.Evaluate("(a1 10)")->GetInteger(), Eq(120));
+
+    loaded.GetHeap().GarbageCollect(loaded.GetGlobalScope(), true);
+    ASSERT_THAT(loaded.Evaluate("(a1 10)")->GetInteger(), Eq(130));
+};
+
+// Symbols and string literals that nothing refers to any more are collected, and identical literals are shared
+TEST_F(JorvikCell, SymbolsAndLiteralsAreCollected)
+{
+    CellAllocator& alloc = eval.GetHeap();
+    eval.Evaluate("(define kept (list (quote kept-symbol)))");
+    eval.Evaluate("(define text (list \"literal\" \"literal\"))");
+    ASSERT_THAT(eval.Evaluate("(car text)"), Eq(eval.Evaluate("(car (cdr text))")));
+    ASSERT_THAT(Sym::IsSymbol("\"literal\""), Eq(false));
+
+    eval.Evaluate("(quote dropped-symbol)");
+    eval.Evaluate("(set! text 0)");
+    unsigned int literals = alloc.GetLiteralCount();
+
+    // A symbol has to go unreferenced for a whole collection before it is freed
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(Sym::IsSymbol("dropped-symbol"), Eq(false));
+    ASSERT_THAT(Sym::IsSymbol("kept-symbol"), Eq(true));
+    ASSERT_THAT(eval.Evaluate("kept")->ToString(), StrEq("(kept-symbol)"));
+    ASSERT_THAT(alloc.GetLiteralCount(), Lt(literals));
+};
+
+// Another evaluator's collections don't free a symbol this one has just looked up
+TEST_F(JorvikCell, SymbolsWaitForEveryHeap)
+{
+    Evaluator other;
+    Sym::Symbol("pending-symbol");
+    other.GetHeap().GarbageCollect(other.GetGlobalScope(), true);
+    other.GetHeap().GarbageCollect(other.GetGlobalScope(), true);
+    ASSERT_THAT(Sym::IsSymbol("pending-symbol"), Eq(true));
+
+    eval.GetHeap().GarbageCollect(eval.GetGlobalScope(), true);
+    eval.GetHeap().GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(Sym::IsSymbol("pending-symbol"), Eq(false));
+};
+
+// Calls don't take frames from the heap; only closures' captured values do, until the closures are collected
+TEST_F(JorvikCell, FramesAreReclaimed)
+{
+    CellAllocator& alloc = eval.GetHeap();
+    eval.Evaluate("(define (sum n) (if (= n 0) 0 (+ n (sum (- n 1)))))");
+    unsigned int frames = alloc.GetFrameCount();
+    ASSERT_THAT(eval.Evaluate("(sum 500)")->GetInteger(), Eq(125250));
+    ASSERT_THAT(alloc.GetFrameCount(), Eq(frames));
+
+    eval.Evaluate("(define ((account bal) amt) (set! bal (+ bal amt)) bal)");
+    eval.Evaluate("(define a1 (account 100))");
+    ASSERT_THAT(alloc.GetFrameCount(), Eq(frames + 1));
+    eval.Evaluate("(account 50)");
+    alloc.GarbageCollect(eval.GetGlobalScope());
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(alloc.GetFrameCount(), Eq(frames + 1));
+    ASSERT_THAT(eval.Evaluate("(a1 10)")->GetInteger(), Eq(110));
+};
+
+// A global that code referred to but nothing defined is forgotten with the code, along with its name
+TEST_F(JorvikCell, UnboundGlobalsAreCollected)
+{
+    CellAllocator& alloc = eval.GetHeap();
+    eval.Evaluate("(define get-later (lambda () later-global))");
+    size_t globals = eval.GetGlobalScope()->GetSymbols().size();
+    for (int index = 0; index < 100; index++)
+    {
+        ASSERT_THROW(eval.Evaluate("(undefined-global" + std::to_string(index) + " 1)"), std::runtime_error);
+    }
+    ASSERT_THAT(eval.GetGlobalScope()->GetSymbols().size(), Eq(globals + 100));
+
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    alloc.GarbageCollect(eval.GetGlobalScope(), true);
+    ASSERT_THAT(eval.GetGlobalScope()->GetSymbols().size(), Eq(globals));
+    ASSERT_THAT(Sym::IsSymbol("undefined-global0"), Eq(false));
+
+    // One that code still refers to stays, and the code sees it defined
+    ASSERT_THAT(Sym::IsSymbol("later-global"), Eq(true));
+    eval.Evaluate("(define later-global 5)");
+    ASSERT_THAT(eval.Evaluate("(get-later)")->GetInteger(), Eq(5));
+};
 }; // JorvikCellTests
 
 #endif
\ No newline at end of file
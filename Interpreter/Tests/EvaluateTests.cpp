@@ -30,6 +30,7 @@
 #include "../Parser.h"
 #include "../Errors.h"
 #include "../Scope.h"
+#include "../CellAllocator.h"
 
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
@@ -40,15 +41,17 @@ using namespace Jorvik::Scheme;
 namespace JorvikEvaluateTests
 {
 
-class JorvikEvaluate : public Test
+// Everything is run by the interpreter, by the virtual machine, and as a tree of analysed nodes
+class JorvikEvaluate : public TestWithParam<Evaluator::Mode>
 {
 public:
+    JorvikEvaluate() { eval.SetMode(GetParam()); }
     Evaluator eval;
 };
 
 #define CHECK_EVAL(a, b) ASSERT_THAT(eval.Interpret(eval.Parse(eval.Tokenize(a)))->ToString(), StrEq(b))
 #define JORVIK_EVALUATE(name, a, b)                     \
-TEST_F(JorvikEvaluate, name)                          \
+TEST_P(JorvikEvaluate, name)                          \
 {                                                   \
     Cell* tokens = eval.Tokenize(a);    \
     Cell* parse = eval.Parse(tokens);         \
@@ -59,11 +62,26 @@ TEST_F(JorvikEvaluate, name)                          \
 
 #define CHECK_EVAL_THROW(a) ASSERT_THROW(eval.Interpret(eval.Parse(eval.Tokenize(a))), std::runtime_error)
 #define JORVIK_EVALUATE_THROW(name, a)                  \
-TEST_F(JorvikEvaluate, name)                            \
+TEST_P(JorvikEvaluate, name)                            \
 {                                                       \
     CHECK_EVAL_THROW(a);                                \
 };
 
+// The error has to say what went wrong, not just happen
+#define CHECK_EVAL_ERROR(a, b)                                  \
+{                                                               \
+    std::string error;                                          \
+    try                                                         \
+    {                                                           \
+        eval.Interpret(eval.Parse(eval.Tokenize(a)));           \
+    }                                                           \
+    catch (std::runtime_error& e)                               \
+    {                                                           \
+        error = e.what();                                       \
+    }                                                           \
+    ASSERT_THAT(error, StartsWith(std::string(b) + "\n"));      \
+}
+
 JORVIK_EVALUATE_THROW(DefineInvalidArgs, "(define 3 4)");
 JORVIK_EVALUATE_THROW(QuoteInvalidArgs, "(quote 1 2)");
 JORVIK_EVALUATE_THROW(IfStatementInvalidArgs, "(if 1 2 3 4)");
@@ -113,7 +131,7 @@ const char* multiLine = R"(
 JORVIK_EVALUATE(MutliLineComments, multiLine, "(1 2 3)");
 
 // Multiline programs
-TEST_F(JorvikEvaluate, VariableScopes)
+TEST_P(JorvikEvaluate, VariableScopes)
 {
     CHECK_EVAL("(define ((account bal) amt) (set! bal (+ bal amt)) bal)", "");
     CHECK_EVAL("(define a1 (account 100))", "");
@@ -123,7 +141,102 @@ TEST_F(JorvikEvaluate, VariableScopes)
     CHECK_EVAL("(a1 10)", "120");
 }
 
-TEST_F(JorvikEvaluate, Lambdas)
+// Locals are resolved to a frame and slot when parsed; internal defines get slots after the parameters.
+// A captured variable is in the closure's own frame, one out.  Globals are resolved to their bindings.
+TEST_P(JorvikEvaluate, LexicalAddresses)
+{
+    Cell* pLambda = eval.Parse(eval.Tokenize("(lambda (a b) (lambda (d) (+ b d)))"));
+    Cell* pSum = pLambda->Cdr()->Cdr()->Car()->Cdr()->Cdr()->Car();
+    ASSERT_THAT(pSum->ToString(), StrEq("(+ b d)"));
+    ASSERT_THAT(*pSum->Car()->GetBinding(), Eq(eval.GetGlobalScope()->FindVariable(Sym::Symbol("+"))));
+    ASSERT_THAT(pSum->Cdr()->Car()->GetDepth(), Eq(1u));
+    ASSERT_THAT(pSum->Cdr()->Car()->GetIndex(), Eq(0u));
+    ASSERT_THAT(pSum->Cdr()->Cdr()->Car()->GetDepth(), Eq(0u));
+    ASSERT_THAT(pSum->Cdr()->Cdr()->Car()->GetIndex(), Eq(0u));
+
+    CHECK_EVAL("(define (counter start) (define next (lambda () (set! n (+ n 1)) n)) (define n start) next)", "");
+    CHECK_EVAL("(define c1 (counter 0))", "");
+    CHECK_EVAL("(c1)", "1");
+    CHECK_EVAL("(c1)", "2");
+    CHECK_EVAL("((counter 10))", "11");
+    CHECK_EVAL_ERROR("((lambda () (define x y) (define y 1) x))", "Variable not found: y");
+    CHECK_EVAL_ERROR("((lambda () (set! z 1) (define z 2) z))", "Could not set variable: z");
+};
+
+// Code refers to a global's binding, so it sees it defined later, and redefined
+TEST_P(JorvikEvaluate, GlobalBindings)
+{
+    CHECK_EVAL("(define get-later (lambda () later))", "");
+    CHECK_EVAL_ERROR("(get-later)", "Variable not found: later");
+    CHECK_EVAL_ERROR("(set! later 1)", "Could not set variable: later");
+    CHECK_EVAL("(define later 1)", "");
+    CHECK_EVAL("(get-later)", "1");
+    CHECK_EVAL("(set! later 2)", "");
+    CHECK_EVAL("(get-later)", "2");
+    CHECK_EVAL("(define later (list 3))", "");
+    CHECK_EVAL("(get-later)", "(3)");
+};
+
+// Each kind of variable is named in the error when it isn't defined, however the code is run
+TEST_P(JorvikEvaluate, VariableErrors)
+{
+    CHECK_EVAL_ERROR("(undefined-variable 1)", "Variable not found: undefined-variable");
+    CHECK_EVAL_ERROR("(set! undefined-variable 1)", "Could not set variable: undefined-variable");
+    CHECK_EVAL_ERROR("(+ undefined-variable 1)", "Variable not found: undefined-variable");
+    CHECK_EVAL_ERROR("((lambda () (define a b) (define b 1) a))", "Variable not found: b");
+    CHECK_EVAL_ERROR("((lambda () (set! b 1) (define b 2) b))", "Could not set variable: b");
+
+    // Boxed, in its own frame and captured by a closure
+    CHECK_EVAL_ERROR("((lambda () (begin (define f (lambda () c)) (define a c) (define c 1) a)))", "Variable not found: c");
+    CHECK_EVAL_ERROR("((lambda () (begin (define f (lambda () c)) (define a (f)) (define c 1) a)))", "Variable not found: c");
+    CHECK_EVAL_ERROR("((lambda () (begin (define f (lambda () (set! c 1))) (f) (define c 2) c)))", "Could not set variable: c");
+};
+
+// Every call's frame comes off a stack, since closures copy what they capture instead of keeping the frame
+TEST_P(JorvikEvaluate, StackedFrames)
+{
+    CellAllocator& alloc = eval.GetHeap();
+    CHECK_EVAL("(define (sum n) (if (= n 0) 0 (+ n (sum (- n 1)))))", "");
+    CHECK_EVAL("(define compose (lambda (f g) (lambda (x) (f (g x)))))", "");
+
+    unsigned int frames = alloc.GetFrameCount();
+    CHECK_EVAL("(sum 100)", "5050");
+    ASSERT_THAT(alloc.GetFrameCount(), Eq(frames));
+    CHECK_EVAL("((compose car cdr) (list 1 2))", "2");
+    ASSERT_THAT(alloc.GetFrameStackDepth(), Eq(0u));
+
+    // An error deep in the recursion still pops everything
+    CHECK_EVAL("(define (bad n) (if (= n 0) (car 1) (+ 1 (bad (- n 1)))))", "");
+    CHECK_EVAL_THROW("(bad 50)");
+    ASSERT_THAT(alloc.GetFrameStackDepth(), Eq(0u));
+};
+
+// A closure holds just the variables it uses.  Those that can change are shared through boxes.
+TEST_P(JorvikEvaluate, FlatClosures)
+{
+    CHECK_EVAL("(define (keep big small) (lambda (x) (+ x small)))", "");
+    Cell* pClosure = eval.Evaluate("(keep (list 1 2 3) 5)");
+    ASSERT_THAT(pClosure->GetScope()->GetSlot(0)->GetInteger(), Eq(5));
+    ASSERT_THAT(pClosure->GetScope()->GetSlot(1), Eq((Cell*)nullptr));
+
+    CHECK_EVAL("(define (cell n) (list (lambda (x) n) (lambda (v) (set! n v))))", "");
+    CHECK_EVAL("(define c (cell 1))", "");
+    CHECK_EVAL("((car c) 0)", "1");
+    CHECK_EVAL("((car (cdr c)) 2)", "");
+    CHECK_EVAL("((car c) 0)", "2");
+
+    // Captured through a lambda that doesn't use it itself
+    CHECK_EVAL("(define (outer a) (lambda (b) (lambda (c) (+ a c))))", "");
+    CHECK_EVAL("(((outer 1) 2) 3)", "4");
+
+    // A parameter defined again after a closure captured it
+    CHECK_EVAL("(define (pd a) (define g (lambda (z) a)) (define a 5) (g 0))", "");
+    CHECK_EVAL("(pd 1)", "5");
+    CHECK_EVAL("(define (pi a) (define g (lambda (z) a)) (if (< 0 1) (define a 6) 0) (g 0))", "");
+    CHECK_EVAL("(pi 1)", "6");
+};
+
+TEST_P(JorvikEvaluate, Lambdas)
 {
     CHECK_EVAL("(define twice (lambda (x) (* 2 x)))", "");
     CHECK_EVAL("(twice 5)", "10");
@@ -134,7 +247,7 @@ TEST_F(JorvikEvaluate, Lambdas)
     CHECK_EVAL("((repeat (repeat twice)) 5)", "80");
 };
 
-TEST_F(JorvikEvaluate, Factorial)
+TEST_P(JorvikEvaluate, Factorial)
 {
     CHECK_EVAL("(define fact (lambda (n) (if (<= n 1) 1 (* n (fact (- n 1))))))", "");
     CHECK_EVAL("(fact 3)", "6");
@@ -142,13 +255,13 @@ TEST_F(JorvikEvaluate, Factorial)
     CHECK_EVAL("(fact 12)", "479001600"); // no bignums; this is as far as we go with 32 bits
 };
 
-TEST_F(JorvikEvaluate, Abs)
+TEST_P(JorvikEvaluate, Abs)
 {
     CHECK_EVAL("(define abs (lambda (n) ((if (> n 0) + -) 0 n)))", "");
     CHECK_EVAL("(list (abs -3) (abs 0) (abs 3))", "(3 0 3)");
 };
 
-TEST_F(JorvikEvaluate, Zip)
+TEST_P(JorvikEvaluate, Zip)
 {
     CHECK_EVAL(("(define combine (lambda (f)"
                  "(lambda (x y)"
@@ -159,7 +272,7 @@ TEST_F(JorvikEvaluate, Zip)
     CHECK_EVAL("(zip (list 1 2 3 4) (list 5 6 7 8))", "((1 5) (2 6) (3 7) (4 8))");
 };
 
-TEST_F(JorvikEvaluate, RiffShuffle)
+TEST_P(JorvikEvaluate, RiffShuffle)
 {
     CHECK_EVAL("(define (append l m) (if (null? l) m (cons (car l) (append (cdr l) m))))", "");
     CHECK_EVAL("(define compose (lambda (f g) (lambda (x) (f (g x)))))", "");
@@ -181,6 +294,36 @@ TEST_F(JorvikEvaluate, RiffShuffle)
     CHECK_EVAL("(riff-shuffle (riff-shuffle (riff-shuffle (list 1 2 3 4 5 6 7 8))))", "(1 2 3 4 5 6 7 8)");
 };
 
+// The virtual machine and the analyzer compile a lambda when it is first called, and keep the code on it
+TEST_P(JorvikEvaluate, CompiledLambdas)
+{
+    CHECK_EVAL("(define (add a b) (+ a b))", "");
+    Cell* pAdd = eval.Evaluate("add");
+    ASSERT_THAT(pAdd->GetLambdaCode(), Eq((Cell*)nullptr));
+    CHECK_EVAL("(add 1 2)", "3");
+    Cell* pCode = pAdd->GetLambdaCode();
+    ASSERT_THAT(pCode != nullptr, Eq(GetParam() != Evaluator::InterpretMode));
+    CHECK_EVAL("(add 30000 20000)", "50000");
+    ASSERT_THAT(pAdd->GetLambdaCode(), Eq(pCode));
+
+    // Operators are only done inline while they are bound to the intrinsics
+    CHECK_EVAL("(define + -)", "");
+    CHECK_EVAL("(add 1 2)", "-1");
+
+    // Another backend compiles it again
+    bool analyze = GetParam() != Evaluator::AnalyzeMode;
+    eval.SetMode(analyze ? Evaluator::AnalyzeMode : Evaluator::VirtualMachineMode);
+    CHECK_EVAL("(add 1 2)", "-1");
+    ASSERT_THAT(pAdd->GetLambdaCode()->GetCode()->backend, Eq(analyze ? CompiledCode::NodeBackend : CompiledCode::BytecodeBackend));
+    eval.SetMode(GetParam());
+
+    // Every frame of a recursion is popped when it returns
+    CHECK_EVAL("(define (count n) (if (= n 0) 0 (- (count (- n 1)) -1)))", "");
+    CHECK_EVAL("(count 200)", "200");
+    ASSERT_THAT(eval.GetHeap().GetFrameStackDepth(), Eq(0u));
+};
+
+INSTANTIATE_TEST_CASE_P(Modes, JorvikEvaluate, Values(Evaluator::InterpretMode, Evaluator::VirtualMachineMode, Evaluator::AnalyzeMode));
 
 }; // JorvikEvaluateaTests
 
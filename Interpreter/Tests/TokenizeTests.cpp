@@ -96,6 +96,38 @@ TEST_F(JorvikTokenize, IdentifiersAreValid)
     ASSERT_THAT(*eval.Tokenize("two\\x20;words")->GetSymbol(), StrEq("two\\x20;words"));
 }
 
+// The same text always gives the same symbol, however it is looked up, and however many there are
+TEST_F(JorvikTokenize, SymbolsAreInterned)
+{
+    const Sym* pSym = Sym::Symbol("interned");
+    ASSERT_THAT(Sym::Symbol(std::string("interned")), Eq(pSym));
+    ASSERT_THAT(Sym::Symbol("interned-symbol", 8), Eq(pSym));
+    ASSERT_THAT(eval.Tokenize("interned")->GetSymbol(), Eq(pSym));
+    ASSERT_THAT(pSym->GetName(), StrEq("interned"));
+
+    std::vector<const Sym*> symbols;
+    for (int i = 0; i < 5000; i++)
+    {
+        symbols.push_back(Sym::Symbol("sym" + std::to_string(i)));
+    }
+    for (int i = 0; i < 5000; i++)
+    {
+        ASSERT_THAT(Sym::Symbol("sym" + std::to_string(i)), Eq(symbols[i]));
+        ASSERT_THAT(std::string(*symbols[i]), StrEq("sym" + std::to_string(i)));
+    }
+    ASSERT_THAT(Sym::Symbol("interned"), Eq(pSym));
+}
+
+// Special forms are tagged on their symbols, which the tokenizer maps keywords to
+TEST_F(JorvikTokenize, SpecialFormsAreTagged)
+{
+    ASSERT_THAT(eval.Tokenize("lambda")->GetSymbol()->GetForm(), Eq(Sym::LambdaForm));
+    ASSERT_THAT(eval.Tokenize("if")->GetSymbol(), Eq(Sym::FormSymbol(Sym::IfForm)));
+    ASSERT_THAT(Sym::Symbol("_set!")->GetForm(), Eq(Sym::SetForm));
+    ASSERT_THAT(Sym::Symbol("if")->GetForm(), Eq(Sym::NoForm));
+    ASSERT_THAT(Sym::Symbol("lambdas")->GetForm(), Eq(Sym::NoForm));
+}
+
 TEST_F(JorvikTokenize, EscapedString)
 {
     ASSERT_THAT(eval.Tokenize("\"escaped\"")->GetString(), StrEq("escaped"));
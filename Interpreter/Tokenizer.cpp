@@ -24,6 +24,7 @@
 #include "Tokenizer.h"
 #include "Evaluator.h"
 #include "Scope.h"
+#include "CellAllocator.h"
 
 // This tokenizer uses a regex to extract all tokens used by the parser.
 // It also recognizes quoting, and builds linked Cells ready for parsing.
@@ -139,20 +140,22 @@ Cell* Tokenizer::Atom(const std::string& token) const
         }
     }
     
+    // String literals come from the heap's constant pool, and are never symbols
+    if (token[0] == '"')
+    {
+        return CellAllocator::Instance().StringLiteral(token.substr(1, token.length() - 2));
+    }
+
     // Check symbol table and return any mappings from symbol->symbol.
     // We ignore mappings to functions at the tokenize stage
-    auto cell = _pScheme->GetGlobalScope()->FindVariable(Sym::Symbol(token));
+    const Sym* pSymbol = Sym::Symbol(token);
+    auto cell = _pScheme->GetGlobalScope()->FindVariable(pSymbol);
     if (cell != nullptr &&
         cell->GetType() & Cell::SymbolType)
     {
         return cell;
     }
-
-    if (token[0] == '"')
-    {
-        return Cell::String(token.substr(1, token.length() - 2).c_str());
-    }
-    return Cell::Symbol(Sym::Symbol(token));
+    return Cell::Symbol(pSymbol);
 }
 
 // Parse a given token
@@ -189,12 +192,15 @@ Cell* Tokenizer::Atom(const std::string& token) const
 
 Cell* Tokenizer::TokenizeToken(const std::string& token)
 {
+    CellAllocator::Instance().SafePoint();
+
     if (token[0] == '(')
     {
         // Return this cell as the next.
         // It's an open bracket, so we know it's going in as the CAR
         // We start with an empty list, of course.
         Cell* pRet = Cell::EmptyList();
+        CellRoot retRoot(pRet);
 
         // Append the next token's contents to our list.
         for(;;)
@@ -231,7 +237,8 @@ Cell* Tokenizer::TokenizeToken(const std::string& token)
     if (itr != _quoteMappings.end())
     {
         // (_quotesymbol ...)
-        return Cell::Pair(Cell::Symbol(itr->second), Cell::Pair(TokenizeToken(NextToken())));       
+        Cell* pQuoted = TokenizeToken(NextToken());
+        return Cell::Pair(Cell::Symbol(itr->second), Cell::Pair(pQuoted));
     }
   
     // Must be an atom
@@ -0,0 +1,517 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#include "pch.h"
+
+#include "VirtualMachine.h"
+#include "Compiler.h"
+#include "Interpreter.h"
+#include "Evaluator.h"
+#include "Cell.h"
+#include "Scope.h"
+#include "Errors.h"
+#include "CellAllocator.h"
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+// Where the compiler can take the address of a label, the code is direct threaded: each instruction ends by jumping
+// straight to the next one's handler.  Otherwise the handlers are the cases of a switch, in a loop.
+#if defined(__GNUC__)
+#define THREADED_CODE 1
+#define OPCODE(op) op:
+#define NEXT() goto *pc->pHandler
+#define THREAD(pCode) if (!(pCode)->threaded) { Thread(pCode, Handlers); }
+#else
+#define THREADED_CODE 0
+#define OPCODE(op) case Instruction::op:
+#define NEXT() continue
+#define THREAD(pCode)
+#endif
+
+#if THREADED_CODE
+// Swap each opcode for the address of its handler
+static void Thread(Bytecode* pCode, const void* const* pHandlers)
+{
+    for (auto& instruction : pCode->instructions)
+    {
+        instruction.pHandler = pHandlers[instruction.op];
+    }
+    pCode->threaded = true;
+}
+#endif
+
+// An operator applied to two small integers is done here, as long as its name is still bound to the intrinsic.
+// Otherwise it is called like any other procedure.
+#define FIXNUM_OPERATOR(op, result)                                                                     \
+    OPCODE(op)                                                                                          \
+    {                                                                                                   \
+        Cell* pLeft = _stack[_stack.size() - 2];                                                        \
+        Cell* pRight = _stack.back();                                                                   \
+        if (Cell::IsFixnum(pLeft) && Cell::IsFixnum(pRight) &&                                          \
+            *pc->ppBinding == _operators->GetSlot(Instruction::op - Instruction::FirstOperatorOp))      \
+        {                                                                                               \
+            tCellInteger left = pLeft->GetInteger();                                                    \
+            tCellInteger right = pRight->GetInteger();                                                  \
+            _stack.pop_back();                                                                          \
+            _stack.back() = result;                                                                     \
+            pc++;                                                                                       \
+            NEXT();                                                                                     \
+        }                                                                                               \
+        goto CallOperator;                                                                              \
+    }
+
+VirtualMachine::VirtualMachine(Evaluator* pScheme, Interpreter* pInterpreter)
+    : _pScheme(pScheme),
+    _pInterpreter(pInterpreter),
+    _compiler(new Compiler(pScheme)),
+    _operators(new Scope())
+{
+    for (unsigned int index = 0; index < Instruction::NumOperators; index++)
+    {
+        _operators->SetSlot(index, *_compiler->GetOperator(index));
+    }
+    CellAllocator::Instance().AddGlobalScope(_operators.get());
+    CellAllocator::Instance().AddStack(&_stack);
+}
+
+VirtualMachine::~VirtualMachine()
+{
+    CellAllocator::Instance().RemoveStack(&_stack);
+    CellAllocator::Instance().RemoveGlobalScope(_operators.get());
+}
+
+// The expression's code is only needed while it runs
+Cell* VirtualMachine::Run(Cell* cell, Scope* pScope)
+{
+    std::unique_ptr<Bytecode> code(_compiler->Compile(cell));
+    return Execute(code.get(), pScope);
+}
+
+// A lambda's code is owned by a cell on its form, which keeps it as long as the lambda is around
+Bytecode* VirtualMachine::GetCode(Cell* pLambda)
+{
+    THROW_ERROR_IF(pLambda->GetLambdaInfo() == nullptr, pLambda, "Lambda has not been resolved: " << pLambda);
+
+    Cell* pCode = pLambda->GetLambdaCode();
+    if (pCode == nullptr || pCode->GetCode() == nullptr || pCode->GetCode()->backend != CompiledCode::BytecodeBackend)
+    {
+        pCode = Cell::Code(_compiler->CompileLambda(pLambda));
+        pLambda->SetLambdaCode(pCode);
+    }
+    return static_cast<Bytecode*>(pCode->GetCode());
+}
+
+// A list of values on the stack, for a procedure's arguments; made just as the interpreter makes it
+Cell* VirtualMachine::MakeList(size_t first, unsigned int count)
+{
+    Cell* pList = Cell::EmptyList();
+    for (unsigned int index = 0; index < count; index++)
+    {
+        pList = pList->Append(_stack[first + index]);
+    }
+    return pList;
+}
+
+// Fill in a new frame from the arguments on the stack, as Scope::Bind does from a list of them.
+// A null value, such as the cdr of the last pair in a list, ends a list early, so those go the long way round.
+void VirtualMachine::Bind(Bytecode* pCode, Scope* pFrame, size_t args, unsigned int numArgs)
+{
+    bool direct = pCode->fixedParams;
+    for (unsigned int index = 0; index < numArgs && direct; index++)
+    {
+        direct = _stack[args + index] != nullptr;
+    }
+
+    if (direct)
+    {
+        THROW_ERROR_IF(numArgs > pCode->numParams, pCode->pParams, "Expected num arguments to match parameters: (" << MakeList(args, numArgs) << " , " << pCode->pParams << ")");
+        for (unsigned int index = 0; index < pCode->numParams; index++)
+        {
+            pFrame->SetSlot(index, index < numArgs ? _stack[args + index] : Cell::EmptyList());
+        }
+    }
+    else
+    {
+        pFrame->Bind(pCode->pParams, MakeList(args, numArgs));
+    }
+    pFrame->BoxSlots(pCode->boxed);
+}
+
+// The main loop.  Each call in progress has its procedure at the base of its part of the stack, which keeps its
+// code alive, with the values it is working on above.  Its frame is on the heap's stack, so the collector sees it.
+// The code at the top level has no procedure or frame of its own.
+// Safe points are at calls, and everything live is on one of the stacks.
+Cell* VirtualMachine::Execute(Bytecode* pCode, Scope* pScope)
+{
+#if THREADED_CODE
+    // In the order of the opcodes
+    static const void* const Handlers[] =
+    {
+        &&ConstantOp, &&LocalOp, &&LocalBoxOp, &&CapturedOp, &&CapturedBoxOp, &&GlobalOp, &&VariableOp,
+        &&SetLocalOp, &&SetGlobalOp, &&SetVariableOp, &&DefineLocalOp, &&DefineLocalBoxOp, &&DefineGlobalOp, 
+        &&DefineVariableOp, &&ClosureOp, &&PopOp, &&JumpOp, &&JumpIfFalseOp, &&CallOp, &&TailCallOp, &&ReturnOp,
+        &&InterpretOp, &&AddOp, &&SubtractOp, &&MultiplyOp, &&LessOp, &&GreaterOp, &&EqualOp, &&LessEqualOp,
+        &&GreaterEqualOp
+    };
+    static_assert(sizeof(Handlers) / sizeof(Handlers[0]) == Instruction::NumOpcodes, "A handler is needed for each opcode");
+#endif
+
+    CellAllocator& heap = CellAllocator::Instance();
+    size_t entryStack = _stack.size();
+    size_t entryCalls = _calls.size();
+    unsigned int numFrames = 0;
+
+    // The current call
+    size_t base = entryStack;
+    bool framed = false;
+    Cell* pResult = nullptr;
+    unsigned int numArgs = 0;
+    bool tail = false;
+
+    THREAD(pCode);
+    const Instruction* pc = &pCode->instructions[0];
+
+    try
+    {
+#if THREADED_CODE
+        NEXT();
+#else
+        for (;;)
+        {
+            switch (pc->op)
+            {
+#endif
+        OPCODE(ConstantOp)
+        {
+            _stack.push_back(pc->pCell);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(LocalOp)
+        {
+            Cell* found = pScope->GetSlot(pc->index);
+            THROW_ERROR_IF(found == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetVariableSymbol());
+            _stack.push_back(found);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(LocalBoxOp)
+        {
+            Cell* found = pScope->GetSlot(pc->index)->Unbox();
+            THROW_ERROR_IF(found == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetVariableSymbol());
+            _stack.push_back(found);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(CapturedOp)
+        {
+            Cell* found = pScope->GetFrame(1)->GetSlot(pc->index);
+            THROW_ERROR_IF(found == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetVariableSymbol());
+            _stack.push_back(found);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(CapturedBoxOp)
+        {
+            Cell* found = pScope->GetFrame(1)->GetSlot(pc->index)->Unbox();
+            THROW_ERROR_IF(found == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetVariableSymbol());
+            _stack.push_back(found);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(GlobalOp)
+        {
+            Cell* found = *pc->ppBinding;
+            THROW_ERROR_IF(found == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetVariableSymbol());
+            _stack.push_back(found);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(VariableOp)
+        {
+            Cell* found = pScope->FindVariable(pc->pCell->GetSymbol());
+            THROW_ERROR_IF(found == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetSymbol());
+            _stack.push_back(found);
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(SetLocalOp)
+        {
+            Cell* pSet = _stack.back();
+            Cell* pSymbol = pc->pCell;
+            Scope* pFrame = pScope->GetFrame(pSymbol->GetDepth());
+            Cell* pSlot = pFrame->GetSlot(pc->index);
+            THROW_ERROR_IF(pSlot == nullptr || (pSymbol->IsBoxed() && pSlot->Unbox() == nullptr), pSet, "Could not set variable: " << (std::string)*pSymbol->GetVariableSymbol());
+            if (pSymbol->IsBoxed())
+            {
+                pSlot->SetBox(pSet);
+            }
+            else
+            {
+                pFrame->SetSlot(pc->index, pSet);
+            }
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(SetGlobalOp)
+        {
+            Cell* pSet = _stack.back();
+            THROW_ERROR_IF(*pc->ppBinding == nullptr, pSet, "Could not set variable: " << (std::string)*pc->pCell->GetVariableSymbol());
+            _pScheme->GetGlobalScope()->SetBinding(pc->ppBinding, pSet);
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(SetVariableOp)
+        {
+            Cell* pSet = _stack.back();
+            THROW_ERROR_IF(!pScope->SetVariable(pc->pCell->GetSymbol(), pSet), pSet, "Could not set variable: " << (std::string)*pc->pCell->GetSymbol());
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(DefineLocalOp)
+        {
+            pScope->SetSlot(pc->index, _stack.back());
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(DefineLocalBoxOp)
+        {
+            pScope->GetSlot(pc->index)->SetBox(_stack.back());
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(DefineGlobalOp)
+        {
+            _pScheme->GetGlobalScope()->SetBinding(pc->ppBinding, _stack.back());
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(DefineVariableOp)
+        {
+            pScope->AddVariable(pc->pCell->GetSymbol(), _stack.back());
+            _stack.back() = Cell::Void();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(ClosureOp)
+        {
+            _stack.push_back(Cell::Lambda(pc->pCell, pScope->Capture(pCode->closures[pc->index])));
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(PopOp)
+        {
+            _stack.pop_back();
+            pc++;
+            NEXT();
+        }
+
+        OPCODE(JumpOp)
+        {
+            pc = &pCode->instructions[pc->index];
+            NEXT();
+        }
+
+        // Anything that isn't the boolean false is 'true'
+        OPCODE(JumpIfFalseOp)
+        {
+            Cell* pTest = _stack.back();
+            _stack.pop_back();
+            if ((pTest->GetType() & Cell::BoolType) && !pTest->GetBool())
+            {
+                pc = &pCode->instructions[pc->index];
+            }
+            else
+            {
+                pc++;
+            }
+            NEXT();
+        }
+
+        OPCODE(CallOp)
+        {
+            numArgs = pc->index;
+            tail = false;
+            goto PerformCall;
+        }
+
+        OPCODE(TailCallOp)
+        {
+            numArgs = pc->index;
+            tail = true;
+            goto PerformCall;
+        }
+
+        OPCODE(ReturnOp)
+        {
+            pResult = _stack.back();
+            goto PerformReturn;
+        }
+
+        OPCODE(InterpretOp)
+        {
+            Cell* pValue = _pInterpreter->Interpret(pc->pCell, pScope);
+            _stack.push_back(pValue);
+            pc++;
+            NEXT();
+        }
+
+        FIXNUM_OPERATOR(AddOp, Cell::Integer(left + right))
+        FIXNUM_OPERATOR(SubtractOp, Cell::Integer(left - right))
+        FIXNUM_OPERATOR(MultiplyOp, Cell::Integer(left * right))
+        FIXNUM_OPERATOR(LessOp, Cell::Boolean(left < right))
+        FIXNUM_OPERATOR(GreaterOp, Cell::Boolean(left > right))
+        FIXNUM_OPERATOR(EqualOp, Cell::Boolean(left == right))
+        FIXNUM_OPERATOR(LessEqualOp, Cell::Boolean(left <= right))
+        FIXNUM_OPERATOR(GreaterEqualOp, Cell::Boolean(left >= right))
+
+        // The operator goes under its arguments
+        CallOperator:
+        {
+            Cell* pProc = *pc->ppBinding;
+            THROW_ERROR_IF(pProc == nullptr, pc->pCell, "Variable not found: " << (const std::string)*pc->pCell->GetVariableSymbol());
+            _stack.insert(_stack.end() - 2, pProc);
+            numArgs = 2;
+            tail = false;
+            goto PerformCall;
+        }
+
+        // A lambda's call gets a frame, and runs its code; a tail call replaces the current call first.
+        // An intrinsic procedure is just called.
+        PerformCall:
+        {
+            heap.SafePoint();
+
+            size_t procIndex = _stack.size() - numArgs - 1;
+            Cell* pProc = _stack[procIndex];
+            if (pProc->GetType() & Cell::LambdaType)
+            {
+                Bytecode* pCallee = GetCode(pProc);
+                THREAD(pCallee);
+                if (tail)
+                {
+                    if (framed)
+                    {
+                        heap.PopFrame();
+                        numFrames--;
+                    }
+                    std::copy(_stack.begin() + procIndex, _stack.end(), _stack.begin() + base);
+                    _stack.resize(base + numArgs + 1);
+                }
+                else
+                {
+                    Call call = { pc + 1, pCode, pScope, base, framed };
+                    _calls.push_back(call);
+                    base = procIndex;
+                }
+
+                pCode = pCallee;
+                pScope = heap.PushFrame(pProc->GetScope());
+                numFrames++;
+                framed = true;
+                Bind(pCode, pScope, base + 1, numArgs);
+                _stack.resize(base + 1);
+                pc = &pCode->instructions[0];
+                NEXT();
+            }
+            else if (pProc->GetType() & Cell::ProcedureType)
+            {
+                pResult = pProc->GetProcedure()(MakeList(procIndex + 1, numArgs));
+                _stack.resize(procIndex);
+                if (tail)
+                {
+                    goto PerformReturn;
+                }
+                _stack.push_back(pResult);
+                pc++;
+                NEXT();
+            }
+            THROW_ERROR(pProc, "Is not a procedure: " << pProc);
+        }
+
+        // Back to the call that made this one, or out of the code at the top level
+        PerformReturn:
+        {
+            if (framed)
+            {
+                heap.PopFrame();
+                numFrames--;
+            }
+            _stack.resize(base);
+            if (_calls.size() == entryCalls)
+            {
+                return pResult;
+            }
+
+            const Call& call = _calls.back();
+            pc = call.pReturn;
+            pCode = call.pCode;
+            pScope = call.pScope;
+            base = call.base;
+            framed = call.framed;
+            _calls.pop_back();
+            _stack.push_back(pResult);
+            NEXT();
+        }
+#if !THREADED_CODE
+            }
+        }
+#endif
+    }
+    catch (...)
+    {
+        // Leave the stacks as they were
+        while (numFrames != 0)
+        {
+            heap.PopFrame();
+            numFrames--;
+        }
+        _stack.resize(entryStack);
+        _calls.resize(entryCalls);
+        throw;
+    }
+}
+
+}
+}
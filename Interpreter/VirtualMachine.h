@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2014 Chris Maughan
+// All rights reserved.
+// http://www.chrismaughan.com, 
+// http://www.github.com/cmaughan
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#pragma once
+
+namespace Jorvik
+{
+namespace Scheme
+{
+
+class Evaluator;
+class Interpreter;
+class Compiler;
+class Cell;
+class Scope;
+struct Bytecode;
+struct Instruction;
+
+// Runs code compiled to bytecode.  Values are kept on a stack, and each call's variables in a frame off the heap's
+// stack, as the interpreter has them, so the two share closures.  A call saves where to return to, rather than
+// recursing, so deep recursion only grows the stacks.
+// A lambda is compiled when it is first called, and its code is kept on its form for the next time.
+class VirtualMachine
+{
+public:
+    VirtualMachine(Evaluator* pScheme, Interpreter* pInterpreter);
+    ~VirtualMachine();
+
+    // Compiles the expression, and runs it at the given scope
+    Cell* Run(Cell* cell, Scope* pScope);
+
+private:
+    Cell* Execute(Bytecode* pCode, Scope* pScope);
+    Bytecode* GetCode(Cell* pLambda);
+    void Bind(Bytecode* pCode, Scope* pFrame, size_t args, unsigned int numArgs);
+    Cell* MakeList(size_t first, unsigned int count);
+
+    // A call in progress, waiting for the one it made to return
+    struct Call
+    {
+        const Instruction* pReturn;
+        Bytecode* pCode;
+        Scope* pScope;
+        size_t base;
+        bool framed;
+    };
+
+    Evaluator* _pScheme;
+    Interpreter* _pInterpreter;
+    std::unique_ptr<Compiler> _compiler;
+    std::vector<Cell*> _stack;
+    std::vector<Call> _calls;
+
+    // The intrinsic operators, which are done inline while their names are still bound to them
+    std::unique_ptr<Scope> _operators;
+};
+
+}
+}
@@ -20,5 +20,13 @@
 #include <numeric>
 #include <cassert>
 #include <exception>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <fstream>
+#include <unordered_map>
 
 #define UNUSED(a) { void* p = &a; }